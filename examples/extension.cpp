@@ -6,7 +6,7 @@
 
 
 namespace coolwidget {
-    GLUE int circleArea(int r)
+    GLUE PURE int circleArea(int r)
     {
         return (int)(3.1415 * r * r);
     }
@@ -58,6 +58,29 @@ namespace coolwidget {
         return res;
     }
 
+    // A PCA9685 16-channel PWM driver at its default address. A channel is
+    // switched on at count 0 and off at [level], out of 4096.
+    static ::touch_develop::i2c::I2CSimple pwm(0x40);
+
+    static void setChannel(int channel, int level)
+    {
+        if (channel < 0 || channel > 15)
+            return;
+        char reg = 0x06 + 4 * channel; // LEDn_ON_L
+        pwm.write8(reg, 0);
+        pwm.write8(reg + 1, 0);
+        pwm.write8(reg + 2, level & 0xff);
+        pwm.write8(reg + 3, (level >> 8) & 0x0f);
+    }
+
+    // Several channels at once, from (channel, level) pairs.
+    GLUE ATOMIC void setChannels(RefBuffer *pairs)
+    {
+        forEachTuple<2>(pairs, [](int16_t *args) {
+            setChannel(args[0], args[1]);
+        });
+    }
+
     uint32_t handler;
     GLUE void registerHandler(uint32_t a) {
         decr(handler);
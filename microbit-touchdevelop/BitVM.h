@@ -9,16 +9,33 @@
 #include "MicroBitImage.h"
 #include "ManagedString.h"
 #include "ManagedType.h"
+#ifdef BITVM_BINARY_LOG
+// only the format string's hash goes out; see BinLog below
+#define printf(fmt, ...) ::bitvm::BinLog::send(BITVM_LOG_ID(fmt), ##__VA_ARGS__)
+#else
 #define printf(...) uBit.serial.printf(__VA_ARGS__)
+#endif
 // #define printf(...)
 
 // for marking glue functions
 #define GLUE /*glue*/
+// ... and functions that never yield to other fibers (no pause, no waiting
+// for events), or that, in addition, have no side effects and don't keep
+// their arguments; both end up in metainfo.json
+#define ATOMIC /*atomic*/
+#define PURE /*pure*/
+// for marking parameters whose reference the function takes over (stores, or
+// decr()s), so that the caller must not decr() it; the default is borrowed
+#define OWNED /*owned*/
+// for marking functions only the runtime and native code call, which
+// functionTable.js keeps out of the function table
+#define INTERNAL /*internal*/
 
 #include <stdio.h>
 #include <string.h>
 #include <vector>
 #include <stdint.h>
+#include <type_traits>
 
 #ifdef DEBUG_MEMLEAKS
 #include <set>
@@ -31,13 +48,28 @@ namespace bitvm {
     ERR_OUT_OF_BOUNDS = 8,
     ERR_REF_DELETED = 7,
     ERR_SIZE = 9,
+    ERR_OUT_OF_MEMORY = 10,
+    ERR_WATCHDOG = 11,
   } ERROR;
 
+  // Events raised by the runtime itself.
+  #define BITVM_ID_RUNTIME 3000
+  #define BITVM_EVT_LOW_MEMORY 1
+  #define BITVM_EVT_ISR_QUEUE 2
+  #define BITVM_EVT_WATCHDOG 3
+  // Watchdog statistics of forever() loops, in the order they started.
+  #define BITVM_ID_FOREVER 3001
+
   extern uint32_t *globals;
   extern int numGlobals;
+  int programHash();
+
 
+  // Saves what the runtime knows to flash, for the next boot to print; see
+  // "Crash records" in bitvm.cpp.
+  INTERNAL void saveCrashRecord(int code, int subcode);
 
-  inline void die() { uBit.panic(42); }
+  inline void die(int code = 42, int subcode = 0) { saveCrashRecord(code, subcode); uBit.panic(42); }
 
   void error(ERROR code, int subcode = 0);
 
@@ -56,8 +88,138 @@ namespace bitvm {
   class RefObject;
   extern std::set<RefObject*> allptrs;
   void debugMemLeaks();
+  void heapSnapshot();
 #endif
 
+  // Object kinds, as reported in heap snapshots.
+  typedef enum {
+    REF_OBJECT = 0,
+    REF_STRUCT = 1,
+    REF_COLLECTION = 2,
+    REF_BUFFER = 3,
+    REF_RECORD = 4,
+    REF_ACTION = 5,
+    REF_LOCAL = 6,
+    REF_REFLOCAL = 7,
+    REF_NATIVE = 8, // StringData or ImageData
+    REF_ENV = 9,
+    REF_STOPWATCH = 10,
+    REF_EXTENSION = 16, // the first id handed out by RefExtension::registerType()
+  } REFTYPE;
+
+  // Objects whose ref-count drops to zero are not destroyed on the spot, but
+  // queued and torn down in bounded slices (see bitvm.cpp), so that dropping
+  // the last reference to a big collection or a deep record graph doesn't
+  // stall the caller.
+  class RefObject;
+  INTERNAL void freeLater(OWNED RefObject *o);
+
+  struct FreeQueueStats {
+    uint32_t maxPauseUs;  // longest single gcSlice() call
+    uint16_t maxQueued;   // high-water mark of the queue
+    uint16_t overflows;   // objects that found the queue full and waited behind it
+  };
+  extern FreeQueueStats freeQueueStats;
+
+  // All RefObject memory goes through these. During an event handler they
+  // bump-allocate from the scratch arena, if one was enabled.
+  INTERNAL void *allocRef(size_t sz);
+  INTERNAL void freeRef(void *p);
+
+  struct ScratchStats {
+    uint32_t heapAllocs;   // RefObjects allocated from the pool or the heap
+    uint32_t arenaAllocs;  // ... and from the scratch arena
+    uint32_t resets;       // times the arena was emptied
+    uint32_t overflows;    // handler allocations that didn't fit in the arena
+    uint32_t escapes;      // handler runs that left live objects in the arena
+  };
+  extern ScratchStats scratchStats;
+
+  #define BITVM_POOL_CLASSES 10
+
+  struct PoolStats {
+    uint16_t used[BITVM_POOL_CLASSES];     // live objects per size class
+    uint16_t capacity[BITVM_POOL_CLASSES]; // slots in pages of that class
+    uint32_t fallbacks;                    // allocations served by the heap
+  };
+  extern PoolStats poolStats;
+
+  // Runtime caches register a function here, which drops whatever can be
+  // dropped when the heap runs low.
+  void registerShrinker(void (*fn)());
+
+  struct ClosureCacheStats {
+    uint32_t hits;   // action::mk() calls that reused a cached closure
+    uint32_t misses; // ... and that allocated a new one
+    uint32_t copies; // hits whose captured values turned out to differ
+  };
+  extern ClosureCacheStats closureCacheStats;
+
+  // Extensions post events from interrupt handlers here, instead of running
+  // TD code (or raising MicroBitEvents) in interrupt context. They're raised
+  // later from a fiber; see "ISR event queue" in bitvm.cpp.
+  namespace isr {
+    bool post(uint16_t id, uint16_t value);
+  }
+
+  struct IsrQueueStats {
+    uint32_t posted;       // isr::post() calls
+    uint32_t overflows;    // ... whose event was dropped, the queue being full
+    uint32_t maxLatencyUs; // longest time from post() to dispatch
+    uint32_t sumLatencyUs; // for the average, over posted - overflows
+  };
+  extern IsrQueueStats isrQueueStats;
+
+  // See "Handler watchdog" in bitvm.cpp; per-handler figures are in the
+  // watchdog namespace.
+  struct WatchdogStats {
+    uint32_t maxBusyUs; // longest time a fiber went without yielding
+    uint32_t overruns;  // times a handler went over its budget
+  };
+  extern WatchdogStats watchdogStats;
+
+  // With BITVM_BINARY_LOG defined, printf() sends the ID of its format string,
+  // computed at compile time, and the raw arguments; the format strings are
+  // not in flash at all. scripts/logdecode.js puts the text back together.
+  // See "Binary log" in bitvm.cpp.
+  #define BITVM_LOG_MARK 0xfe
+  #define BITVM_LOG_ID_MASK 0x1fffff // 3-byte varints
+  #define BITVM_LOG_ID(fmt) \
+    (::std::integral_constant<uint32_t, ::bitvm::BinLog::hash(fmt) & BITVM_LOG_ID_MASK>::value)
+
+  class BinLog
+  {
+  public:
+    // FNV-1a
+    static constexpr uint32_t hash(const char *s, uint32_t h = 2166136261u)
+    {
+      return *s ? hash(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+    }
+
+    static void begin(uint32_t id);
+    static void arg(uint32_t v);
+    static void arg(const char *s);
+    static void arg(char *s) { arg((const char*)s); }
+    template <typename T>
+    static void arg(T *p) { arg((uint32_t)p); }
+
+    static void args() {}
+    template <typename T, typename... Rest>
+    static void args(T v, Rest... rest)
+    {
+      arg(v);
+      args(rest...);
+    }
+
+    template <typename... Args>
+    static int send(uint32_t id, Args... a)
+    {
+      begin(id);
+      args(a...);
+      return 0;
+    }
+  };
+
   // A base abstract class for ref-counted objects.
   class RefObject
   {
@@ -93,15 +255,39 @@ namespace bitvm {
     {
       //printf("DECR "); this->print();
       if (--refcnt == 0) {
-        delete this;
+        freeLater(this);
       }
     }
 
+    // Called on dead objects only. Drops at most [budget] of the outgoing
+    // references and returns how many were dropped; 0 means the object holds
+    // no more references and can be deleted.
+    virtual int releaseRefs(int budget)
+    {
+      return 0;
+    }
+
     virtual void print()
     {
       printf("RefObject %p\n", this);
     }
 
+    static void *operator new(size_t sz)
+    {
+      return allocRef(sz);
+    }
+
+    // Used by record::mk and action::mk, which allocate extra space for fields.
+    static void *operator new(size_t sz, void *p)
+    {
+      return p;
+    }
+
+    static void operator delete(void *p)
+    {
+      freeRef(p);
+    }
+
     virtual ~RefObject()
     {
       // This is just a base class for ref-counted objects.
@@ -111,11 +297,17 @@ namespace bitvm {
 #endif
     }
 
-    // This is used by index_of function, overridden in RefString
+    // This is used by collection::index_of() on collections of refs
     virtual bool equals(RefObject *other)
     {
       return this == other;
     }
+
+    // These describe the object for heap snapshots.
+    virtual REFTYPE typeId() { return REF_OBJECT; }
+    virtual uint32_t byteSize() { return sizeof(RefObject); }
+    virtual int numRefs() { return 0; }
+    virtual uint32_t getRef(int idx) { return 0; }
   };
 
   // Checks if object has a VTable, or if its RefCounted* from the runtime.
@@ -126,6 +318,39 @@ namespace bitvm {
     return (*((uint32_t*)e) & 1) == 0;
   }
 
+  // Objects living in flash (string literals, the "true"/"false" strings,
+  // read-only images, closure-less action pointers) are never ref-counted.
+  // On the nRF51 RAM starts at 0x20000000, so everything below it, including
+  // NULL, can be skipped with a single compare, before touching the object.
+  #define BITVM_RAM_START 0x20000000
+
+  // Object header layout. scripts/functionTable.js copies the BITVM_ABI_*
+  // values to the "abi" section of generated/metainfo.json, so that code
+  // generators can inline incr()/decr() and only call the shims when a count
+  // drops to zero (or for a RefObject, also when it's zero already).
+  //   - values below IMMORTAL_BELOW are never counted
+  //   - if the bit NATIVE_TAG_MASK of the first word is clear, it's a
+  //     RefObject: that word is the vtable, and the count is the halfword at
+  //     REFCNT_OFFSET, in steps of 1
+  //   - otherwise it's a DAL RefCounted (StringData, ImageData): the count is
+  //     the halfword at NATIVE_REFCNT_OFFSET, stored as 2n+1, in steps of 2;
+  //     NATIVE_READONLY marks ones that are never counted
+  #define BITVM_ABI_IMMORTAL_BELOW BITVM_RAM_START
+  #define BITVM_ABI_REFCNT_OFFSET 4
+  #define BITVM_ABI_REFCNT_WIDTH 2
+  #define BITVM_ABI_REFCNT_STEP 1
+  #define BITVM_ABI_NATIVE_TAG_MASK 1
+  #define BITVM_ABI_NATIVE_REFCNT_OFFSET 0
+  #define BITVM_ABI_NATIVE_REFCNT_WIDTH 2
+  #define BITVM_ABI_NATIVE_REFCNT_STEP 2
+  #define BITVM_ABI_NATIVE_READONLY 0xffff
+
+  // Internal; 'inline' on the same line keeps it out of the function table.
+  static inline bool isImmortal(uint32_t e)
+  {
+    return e < BITVM_RAM_START;
+  }
+
   // The standard calling convention is:
   //   - when a pointer is loaded from a local/global/field etc, and incr()ed
   //     (in other words, its presence on stack counts as a reference)
@@ -135,7 +360,7 @@ namespace bitvm {
   inline
   void incr(uint32_t e)
   {
-    if (e) {
+    if (!isImmortal(e)) {
       if (hasVTable(e))
         ((RefObject*)e)->ref();
       else
@@ -144,9 +369,9 @@ namespace bitvm {
   }
 
   inline 
-  void decr(uint32_t e)
+  void decr(OWNED uint32_t e)
   {
-    if (e) {
+    if (!isImmortal(e)) {
       if (hasVTable(e))
         ((RefObject*)e)->unref();
       else
@@ -171,9 +396,83 @@ namespace bitvm {
       printf("RefStruct %p r=%d\n", this, refcnt);
     }
 
+    virtual REFTYPE typeId() { return REF_STRUCT; }
+    virtual uint32_t byteSize() { return sizeof(*this); }
+
     RefStruct(const T& i) : v(i) {}
   };
 
+  // Base for ref-counted types defined by extensions; see "Defining custom
+  // ref-counted types" in EXTENSIONS.md. Subclasses free their state in the
+  // destructor, and may override equals(), print() and byteSize().
+  class RefExtension
+    : public RefObject
+  {
+  public:
+    // fits in the padding after refcnt
+    uint16_t extType;
+
+    RefExtension(REFTYPE type) : extType(type) {}
+
+    // Call once per type, at startup. [name] is used in diagnostics.
+    static REFTYPE registerType(const char *name);
+    static const char *typeName(REFTYPE type);
+
+    virtual void print()
+    {
+      printf("%s %p r=%d\n", typeName(typeId()), this, refcnt);
+    }
+
+    virtual REFTYPE typeId() { return (REFTYPE)extType; }
+    virtual uint32_t byteSize() { return sizeof(*this); }
+  };
+
+  // Element storage of collections and buffers, a heap block of its own. With
+  // BITVM_ALLOC_TRACE it's traced too (see "Allocation trace" in bitvm.cpp),
+  // so that scripts/allocsim.js sees the whole of the heap.
+#ifdef BITVM_ALLOC_TRACE
+  class PayloadTrace
+  {
+  public:
+    static void alloc(void *p, uint32_t size);
+    static void free(void *p);
+  };
+
+  template <typename T>
+  struct TracedAllocator
+  {
+    typedef T value_type;
+
+    TracedAllocator() {}
+    template <typename U>
+    TracedAllocator(const TracedAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+      T *p = std::allocator<T>().allocate(n);
+      PayloadTrace::alloc(p, n * sizeof(T));
+      return p;
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+      PayloadTrace::free(p);
+      std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const TracedAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const TracedAllocator<U> &) const { return false; }
+  };
+
+  template <typename T>
+  using PayloadVector = std::vector<T, TracedAllocator<T>>;
+#else
+  template <typename T>
+  using PayloadVector = std::vector<T>;
+#endif
+
   // A ref-counted collection of either primitive or ref-counted objects (String, Image,
   // user-defined record, another collection)
   class RefCollection
@@ -183,7 +482,7 @@ namespace bitvm {
     // 1 - collection of refs (need decr)
     // 2 - collection of strings (in fact we always have 3, never 2 alone)
     uint16_t flags;
-    std::vector<uint32_t> data;
+    PayloadVector<uint32_t> data;
 
     RefCollection(uint16_t f)
     {
@@ -201,10 +500,27 @@ namespace bitvm {
       data.resize(0);
     }
 
+    virtual int releaseRefs(int budget)
+    {
+      int n = 0;
+      if (flags & 1)
+        while (n < budget && data.size() > 0) {
+          decr(data.back());
+          data.pop_back();
+          n++;
+        }
+      return n;
+    }
+
     virtual void print()
     {
       printf("RefCollection %p r=%d flags=%d size=%d [%p, ...]\n", this, refcnt, flags, data.size(), data.size() > 0 ? data[0] : 0);
     }
+
+    virtual REFTYPE typeId() { return REF_COLLECTION; }
+    virtual uint32_t byteSize() { return sizeof(*this) + data.capacity() * sizeof(uint32_t); }
+    virtual int numRefs() { return (flags & 1) ? data.size() : 0; }
+    virtual uint32_t getRef(int idx) { return data[idx]; }
   };
 
   // A ref-counted byte buffer
@@ -212,7 +528,7 @@ namespace bitvm {
     : public RefObject
   {
   public:
-    std::vector<uint8_t> data;
+    PayloadVector<uint8_t> data;
 
     virtual ~RefBuffer()
     {
@@ -223,8 +539,29 @@ namespace bitvm {
     {
       printf("RefBuffer %p r=%d size=%d [%p, ...]\n", this, refcnt, data.size(), data.size() > 0 ? data[0] : 0);
     }
+
+    virtual REFTYPE typeId() { return REF_BUFFER; }
+    virtual uint32_t byteSize() { return sizeof(*this) + data.capacity(); }
   };
 
+  // Batched GLUE entry points get their arguments packed in a buffer, [N]
+  // little-endian 16 bit values per call (see buffer::add_int16()), and
+  // handle them all in one go: fn(args) is called for each tuple, where args
+  // is an int16_t[N]. Returns the number of tuples.
+  template <int N, typename F>
+  inline int forEachTuple(RefBuffer *buf, F fn)
+  {
+    const int stride = N * sizeof(int16_t);
+    check(buf->data.size() % stride == 0, ERR_SIZE, 4);
+    int16_t args[N];
+    int n = 0;
+    for (uint32_t off = 0; off < buf->data.size(); off += stride, n++) {
+      memcpy(args, &buf->data[off], stride);
+      fn(args);
+    }
+    return n;
+  }
+
   // A ref-counted, user-defined Touch Develop object.
   class RefRecord
     : public RefObject
@@ -247,11 +584,30 @@ namespace bitvm {
       }
     }
 
+    // Fields are released from the end, shrinking reflen as we go, so that
+    // the destructor has nothing left to do.
+    virtual int releaseRefs(int budget)
+    {
+      int n = 0;
+      while (n < budget && reflen > 0) {
+        reflen--;
+        decr(fields[reflen]);
+        fields[reflen] = 0;
+        n++;
+      }
+      return n;
+    }
+
     virtual void print()
     {
       printf("RefRecord %p r=%d size=%d (%d refs)\n", this, refcnt, len, reflen);
     }
 
+    virtual REFTYPE typeId() { return REF_RECORD; }
+    virtual uint32_t byteSize() { return sizeof(*this) + len * sizeof(uint32_t); }
+    virtual int numRefs() { return reflen; }
+    virtual uint32_t getRef(int idx) { return fields[idx]; }
+
     inline uint32_t ld(int idx)
     {
       check(reflen <= idx && idx < len, ERR_OUT_OF_BOUNDS, 1);
@@ -284,8 +640,20 @@ namespace bitvm {
 
   class RefAction;
   typedef uint32_t (*ActionCB)(RefAction *, uint32_t *, uint32_t arg);
-
-  // Ref-counted function pointer. It's currently always a ()=>void procedure pointer.
+  // Lambdas with more parameters get them in the following argument
+  // registers (and on the stack). Passing more arguments than a lambda takes
+  // is harmless, so all calls can go through this one.
+  typedef uint32_t (*ActionCB3)(RefAction *, uint32_t *, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+  // The closure cache, see action::mk(). It doesn't hold references; a
+  // closure takes itself out when it's destroyed.
+  #define BITVM_CLOSURE_CACHE 8
+  extern RefAction *closureCache[BITVM_CLOSURE_CACHE];
+  static inline int closureSlot(ActionCB func) { return ((uint32_t)func >> 1) % BITVM_CLOSURE_CACHE; }
+
+  // Ref-counted function pointer, with up to three arguments and a result.
+  // Arguments are borrowed: the lambda ref()s whatever it keeps. A ref-counted
+  // result is owned by the caller.
   class RefAction
     : public RefObject
   {
@@ -299,17 +667,38 @@ namespace bitvm {
     // fields[] contain captured locals
     virtual ~RefAction()
     {
+      RefAction **slot = &closureCache[closureSlot(func)];
+      if (*slot == this)
+        *slot = NULL;
       for (int i = 0; i < this->reflen; ++i) {
         decr(fields[i]);
         fields[i] = 0;
       }
     }
 
+    // Same as for RefRecord.
+    virtual int releaseRefs(int budget)
+    {
+      int n = 0;
+      while (n < budget && reflen > 0) {
+        reflen--;
+        decr(fields[reflen]);
+        fields[reflen] = 0;
+        n++;
+      }
+      return n;
+    }
+
     virtual void print()
     {
       printf("RefAction %p r=%d pc=0x%lx size=%d (%d refs)\n", this, refcnt, (const uint8_t*)func - (const uint8_t*)bytecode, len, reflen);
     }
 
+    virtual REFTYPE typeId() { return REF_ACTION; }
+    virtual uint32_t byteSize() { return sizeof(*this) + len * sizeof(uint32_t); }
+    virtual int numRefs() { return reflen; }
+    virtual uint32_t getRef(int idx) { return fields[idx]; }
+
     inline void st(int idx, uint32_t v)
     {
       //printf("ST [%d] = %d ", idx, v); this->print();
@@ -325,6 +714,15 @@ namespace bitvm {
       this->unref();
       return r;
     }
+
+    inline uint32_t run3(uint32_t arg0, uint32_t arg1, uint32_t arg2)
+    {
+      this->ref();
+      // through void (*)() so -Wcast-function-type doesn't complain
+      uint32_t r = ((ActionCB3)(void (*)())this->func)(this, &this->fields[0], arg0, arg1, arg2);
+      this->unref();
+      return r;
+    }
   };
 
   // These two are used to represent locals written from inside inline functions
@@ -339,6 +737,9 @@ namespace bitvm {
       printf("RefLocal %p r=%d v=%d\n", this, refcnt, v);
     }
 
+    virtual REFTYPE typeId() { return REF_LOCAL; }
+    virtual uint32_t byteSize() { return sizeof(*this); }
+
     RefLocal() : v(0) {}
   };
 
@@ -353,13 +754,72 @@ namespace bitvm {
       printf("RefRefLocal %p r=%d v=%p\n", this, refcnt, (void*)v);
     }
 
+    virtual REFTYPE typeId() { return REF_REFLOCAL; }
+    virtual uint32_t byteSize() { return sizeof(*this); }
+    virtual int numRefs() { return 1; }
+    virtual uint32_t getRef(int idx) { return v; }
+
     RefRefLocal() : v(0) {}
 
+    virtual int releaseRefs(int budget)
+    {
+      if (v == 0)
+        return 0;
+      decr(v);
+      v = 0;
+      return 1;
+    }
+
     virtual ~RefRefLocal()
     {
       decr(v);
     }
   };
+
+  // All locals of one scope that are written from inside inline functions,
+  // in a single object shared by every closure created in that scope. This
+  // replaces one RefLocal/RefRefLocal per local. The layout is that of
+  // RefRecord: ref-counted locals first, fields[] starting at byte offset 8,
+  // so the emitter can load and store non-ref locals directly.
+  class RefEnv
+    : public RefRecord
+  {
+  public:
+    virtual void print()
+    {
+      printf("RefEnv %p r=%d size=%d (%d refs)\n", this, refcnt, len, reflen);
+    }
+
+    virtual REFTYPE typeId() { return REF_ENV; }
+  };
+
+  // Microsecond timing for programs; see the stopwatch namespace in bitvm.cpp.
+  // Times are from us_ticker_read(), which wraps every 71 minutes, so only
+  // differences are kept. On the device it has a resolution of about 30.5us.
+  class RefStopwatch
+    : public RefObject
+  {
+  public:
+    bool running;
+    uint32_t startUs;    // when start() was last called
+    uint32_t lapStartUs; // when the current lap started
+    uint32_t elapsedUs;  // up to the last stop()
+    uint32_t laps;
+    uint32_t lapTotalUs;
+    uint32_t lapMinUs;
+
+    virtual void print()
+    {
+      printf("RefStopwatch %p r=%d elapsed=%d laps=%d\n", this, refcnt, elapsedUs, laps);
+    }
+
+    virtual REFTYPE typeId() { return REF_STOPWATCH; }
+    virtual uint32_t byteSize() { return sizeof(*this); }
+
+    RefStopwatch()
+      : running(false), startUs(0), lapStartUs(0), elapsedUs(0),
+        laps(0), lapTotalUs(0), lapMinUs(0) {}
+  };
 }
 
 #endif
@@ -382,6 +382,8 @@ namespace touch_develop {
 
     int getCurrentTime();
 
+    int getCurrentTimeUs();
+
     int i2c_read(int addr);
 
     void i2c_write(int addr, char c);
@@ -0,0 +1,177 @@
+// Shim benchmarks for QEMU's microbit machine; see "QEMU benchmarks" in
+// README.md. This takes the place of main.cpp: instead of exec_binary(), it
+// calls shims directly, each case BENCH_ITERATIONS times, and prints the
+// average number of instructions per call over semihosting. Then it runs
+// what a typical radio program does, for the energy report printed on exit.
+
+#include "BitVM.h"
+#include "MicroBitTouchDevelop.h"
+
+// QEMU is run with -icount shift=ICOUNT_SHIFT: each instruction advances the
+// virtual clock by 2^ICOUNT_SHIFT ns, and SysTick counts that clock at 16MHz.
+#ifndef ICOUNT_SHIFT
+#define ICOUNT_SHIFT 6
+#endif
+
+#define BENCH_ITERATIONS 500
+
+// The radio scenario: send a number, then pause(), this many times
+#define RADIO_SENDS 10
+#define RADIO_PAUSE_MS 200
+
+namespace bitvm {
+  // The code generator calls these through the function table; they're not
+  // in any header.
+  uint32_t ldfld(RefRecord *r, int idx);
+  void stfldRef(RefRecord *r, int idx, uint32_t val);
+  uint32_t ldglb(int idx);
+  void stglbRef(uint32_t v, int idx);
+  void incrGlobal(int idx, int delta);
+  RefAction *stclo(RefAction *a, int idx, uint32_t v);
+
+  namespace record {
+    RefRecord *mk(int reflen, int totallen);
+  }
+  namespace collection {
+    RefCollection *mk(uint32_t flags);
+    void add(RefCollection *c, uint32_t x);
+    uint32_t at(RefCollection *c, int x);
+    void remove_at(RefCollection *c, int x);
+  }
+  namespace buffer {
+    RefBuffer *mk(uint32_t size);
+    uint32_t at(RefBuffer *c, int x);
+  }
+  namespace string {
+    StringData *concat(StringData *s1, StringData *s2);
+    bool equals(StringData *s1, StringData *s2);
+  }
+  namespace action {
+    uint32_t mk(int reflen, int totallen, int startptr);
+    void run1(uint32_t a, int arg);
+  }
+}
+
+using namespace bitvm;
+
+static uint32_t benchGlobals[4];
+static RefRecord *rec;
+static RefCollection *coll;
+static RefBuffer *buf;
+static StringData *str1, *str2;
+static uint32_t closure;
+static volatile uint32_t sink;
+
+// Two lambdas as the code generator lays them out: 0xffff, 0, then Thumb
+// code, here just "bx lr". They're in different closure cache slots.
+static uint16_t lambdaCode[8] __attribute__((aligned(4))) = {
+  0xffff, 0x0000, 0x4770, 0x0000,
+  0xffff, 0x0000, 0x4770, 0x0000,
+};
+
+static void benchEmpty() {}
+
+// OWNED arguments include the caller's ref().
+static void benchIncrDecr() { incr((uint32_t)rec); decr((uint32_t)rec); }
+static void benchIncrDecrString() { incr((uint32_t)str1); decr((uint32_t)str1); }
+static void benchLdfld() { rec->ref(); sink = ldfld(rec, 1); }
+static void benchStfldRef() { rec->ref(); str1->incr(); stfldRef(rec, 0, (uint32_t)str1); }
+static void benchLdglb() { sink = ldglb(1); }
+static void benchStglbRef() { str1->incr(); stglbRef((uint32_t)str1, 0); }
+static void benchIncrGlobal() { incrGlobal(1, 1); }
+static void benchRecordMk() { decr((uint32_t)record::mk(1, 3)); }
+static void benchCollectionAdd() { collection::add(coll, 7); collection::remove_at(coll, 8); }
+static void benchCollectionAt() { sink = collection::at(coll, 3); }
+static void benchBufferAt() { sink = buffer::at(buf, 5); }
+static void benchConcat() { decr((uint32_t)string::concat(str1, str2)); }
+static void benchEquals() { sink = string::equals(str1, str2); }
+static void benchMultiply() { sink = touch_develop::number::multiply(sink | 12345, 678); }
+static void benchDivide() { sink = touch_develop::number::divide(sink | 12345, 678); }
+static void benchMod() { sink = touch_develop::math::mod(sink | 12345, 678); }
+static void benchClosureMk() {
+  uint32_t a = action::mk(1, 1, 0);
+  rec->ref();
+  decr((uint32_t)stclo((RefAction*)a, 0, (uint32_t)rec));
+}
+static void benchRun1() { action::run1(closure, 1); }
+static void benchAllocRef() { freeRef(allocRef(16)); }
+
+struct Bench {
+  const char *name;
+  void (*fn)();
+};
+
+static const Bench benches[] = {
+  { "incr+decr (record)", benchIncrDecr },
+  { "incr+decr (string)", benchIncrDecrString },
+  { "ldfld", benchLdfld },
+  { "stfldRef", benchStfldRef },
+  { "ldglb", benchLdglb },
+  { "stglbRef", benchStglbRef },
+  { "incrGlobal", benchIncrGlobal },
+  { "record::mk+decr", benchRecordMk },
+  { "collection::add+remove_at", benchCollectionAdd },
+  { "collection::at", benchCollectionAt },
+  { "buffer::at", benchBufferAt },
+  { "string::concat+decr", benchConcat },
+  { "string::equals", benchEquals },
+  { "number::multiply", benchMultiply },
+  { "number::divide", benchDivide },
+  { "math::mod", benchMod },
+  { "action::mk+stclo+decr", benchClosureMk },
+  { "action::run1", benchRun1 },
+  { "allocRef+freeRef", benchAllocRef },
+};
+
+static uint64_t timeIt(void (*fn)())
+{
+  fn(); // warm up: first allocations, the closure cache
+  uint64_t start = systick_read();
+  for (int i = 0; i < BENCH_ITERATIONS; ++i)
+    fn();
+  return systick_read() - start;
+}
+
+int main()
+{
+  globals = benchGlobals;
+  numGlobals = sizeof(benchGlobals) / sizeof(benchGlobals[0]);
+  bytecode = lambdaCode;
+
+  rec = record::mk(1, 2);
+  coll = collection::mk(0);
+  for (int i = 0; i < 8; ++i)
+    collection::add(coll, i);
+  buf = buffer::mk(16);
+  str1 = ManagedString("hello, world").leakData();
+  str2 = ManagedString("hello, there").leakData();
+  closure = action::mk(1, 1, 4);
+
+  uint64_t base = timeIt(benchEmpty);
+
+  printf("%-28s %s\n", "shim", "instructions/call");
+  for (unsigned i = 0; i < sizeof(benches) / sizeof(benches[0]); ++i) {
+    uint64_t ticks = timeIt(benches[i].fn) - base;
+    // a tick is 62.5ns; in tenths of an instruction
+    uint32_t insns10 = (uint32_t)(ticks * 625 / (1 << ICOUNT_SHIFT) / BENCH_ITERATIONS);
+    printf("%-28s %lu.%lu\n", benches[i].name, (unsigned long)(insns10 / 10), (unsigned long)(insns10 % 10));
+  }
+
+  decr(closure);
+  decr((uint32_t)rec);
+  coll->unref();
+  buf->unref();
+  str1->decr();
+  str2->decr();
+
+  // As in "on every 200ms: radio->send number(...)": the radio stays on from
+  // the first send, the display is on throughout, and the CPU sleeps in
+  // pause(). The energy report only covers this part.
+  printf("\nradio: %d sends, %dms apart\n", RADIO_SENDS, RADIO_PAUSE_MS);
+  energy_reset();
+  for (int i = 0; i < RADIO_SENDS; ++i) {
+    touch_develop::micro_bit::datagramSendNumber(i);
+    touch_develop::micro_bit::pause(RADIO_PAUSE_MS);
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef MANAGED_STRING_H
+#define MANAGED_STRING_H
+
+// Stand-in for microbit-dal's ManagedString.h, for the QEMU benchmarks. The
+// layout of RefCounted and StringData, and the ref-counting, are the DAL's,
+// since the runtime (and BITVM_ABI_NATIVE_*) depend on them.
+
+#include <stdint.h>
+
+struct RefCounted
+{
+    // 2n+1 for n references; 0xffff for read-only (flash) data
+    uint16_t refCount;
+
+    void init();
+    void incr();
+    void decr();
+    bool isReadOnly();
+};
+
+struct StringData : RefCounted
+{
+    uint16_t len;
+    char data[0];
+};
+
+class ManagedString
+{
+    StringData *ptr;
+
+    void initEmpty();
+    void initString(const char *str, int length);
+
+public:
+    ManagedString();
+    ManagedString(const char *str);
+    ManagedString(const char *str, const int16_t length);
+    ManagedString(const int value);
+    ManagedString(const char value);
+    ManagedString(StringData *p);
+    ManagedString(const ManagedString &s);
+    ~ManagedString();
+
+    ManagedString& operator=(const ManagedString &s);
+    ManagedString operator+(const ManagedString &s);
+    bool operator==(const ManagedString &s);
+
+    StringData *leakData();
+    ManagedString substring(int start, int length);
+    char charAt(int index);
+    int length() { return ptr->len; }
+    const char *toCharArray() { return ptr->data; }
+
+    static ManagedString EmptyString;
+};
+
+#endif
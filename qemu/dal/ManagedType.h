@@ -0,0 +1,55 @@
+#ifndef MANAGED_TYPE_H
+#define MANAGED_TYPE_H
+
+// Stand-in for microbit-dal's ManagedType.h, for the QEMU benchmarks.
+
+template <class T>
+class ManagedType
+{
+protected:
+    void init(T *ptr)
+    {
+        object = ptr;
+        ref = new int(1);
+    }
+
+public:
+    T *object;
+    int *ref;
+
+    ManagedType() : object(NULL), ref(new int(1)) {}
+    ManagedType(T *ptr) { init(ptr); }
+
+    ManagedType(const ManagedType<T> &t) : object(t.object), ref(t.ref)
+    {
+        (*ref)++;
+    }
+
+    ~ManagedType()
+    {
+        if (--(*ref) == 0) {
+            delete object;
+            delete ref;
+        }
+    }
+
+    ManagedType<T>& operator=(const ManagedType<T> &t)
+    {
+        if (this == &t)
+            return *this;
+        if (--(*ref) == 0) {
+            delete object;
+            delete ref;
+        }
+        object = t.object;
+        ref = t.ref;
+        (*ref)++;
+        return *this;
+    }
+
+    T *get() { return object; }
+    T *operator->() { return object; }
+    int getReferences() { return *ref; }
+};
+
+#endif
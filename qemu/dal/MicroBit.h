@@ -0,0 +1,277 @@
+#ifndef MICROBIT_H
+#define MICROBIT_H
+
+// Stand-in for microbit-dal's MicroBit.h, for the QEMU benchmarks. Only what
+// the runtime refers to is declared. Serial output goes to the host through
+// semihosting and the clocks run off SysTick (see dal.cpp); peripherals that
+// QEMU doesn't model are inert, their methods accept anything and return 0,
+// but the time they're powered for is accounted (see "Energy" in dal.cpp).
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "nrf51.h"
+#include "ManagedString.h"
+#include "ManagedType.h"
+#include "MicroBitImage.h"
+
+using namespace std;
+
+#define DAL_STUB(name) template <typename... Args> int name(Args...) { return 0; }
+
+// Not in the DAL: what draws current, besides the CPU.
+enum EnergyState {
+    ENERGY_SLEEP,           // CPU waiting in fiber_sleep()
+    ENERGY_RADIO,
+    ENERGY_DISPLAY,
+    ENERGY_ACCELEROMETER,
+    ENERGY_COMPASS,
+    ENERGY_STATES
+};
+
+void energy_set(EnergyState state, bool on);
+void energy_reset();
+void energy_report();
+
+// The sensors are powered up when first read, and stay on.
+#define DAL_SENSOR_STUB(name, state) \
+    template <typename... Args> int name(Args...) { energy_set(state, true); return 0; }
+
+#define MICROBIT_OK                         0
+#define MICROBIT_EVT_ANY                    0
+#define MICROBIT_ID_BUTTON_A                1
+#define MICROBIT_ID_BUTTON_B                2
+#define MICROBIT_ID_IO_P0                   7
+#define MICROBIT_ID_IO_P1                   8
+#define MICROBIT_ID_IO_P2                   9
+#define MICROBIT_ID_BUTTON_AB               26
+#define MICROBIT_ID_RADIO                   29
+#define MICROBIT_ID_NOTIFY_ONE              1022
+#define MICROBIT_ID_NOTIFY                  1023
+#define MICROBIT_BUTTON_EVT_CLICK           3
+#define MICROBIT_RADIO_EVT_DATAGRAM         1
+#define MICROBIT_RADIO_DEFAULT_GROUP        0
+#define MES_REMOTE_CONTROL_ID               1001
+#define MES_CAMERA_ID                       1002
+#define MES_ALERTS_ID                       1004
+#define MES_SIGNAL_STRENGTH_ID              1101
+#define MES_DEVICE_INFO_ID                  1103
+#define MES_DPAD_CONTROLLER_ID              1104
+#define MES_BROADCAST_GENERAL_ID            2000
+#define CREATE_ONLY                         0
+#define MESSAGE_BUS_LISTENER_QUEUE_IF_BUSY  0
+
+// The nRF51 core clock, which is what SysTick counts.
+#define MICROBIT_CPU_HZ                     16000000
+
+enum DisplayMode {
+    DISPLAY_MODE_BLACK_AND_WHITE,
+    DISPLAY_MODE_GREYSCALE,
+};
+
+class MicroBitEvent
+{
+public:
+    uint16_t source;
+    uint16_t value;
+    uint64_t timestamp;
+
+    MicroBitEvent(uint16_t source = 0, uint16_t value = 0, int mode = 0);
+};
+
+class MicroBitComponent
+{
+public:
+    virtual void systemTick() {}
+    virtual void idleTick() {}
+};
+
+class PacketBuffer
+{
+public:
+    int length() { return 0; }
+    uint8_t operator[](int i) { return 0; }
+    int getRSSI() { return 0; }
+};
+
+class MicroBitPin
+{
+public:
+    DAL_STUB(isTouched)
+    DAL_STUB(getAnalogValue)
+    DAL_STUB(setAnalogValue)
+    DAL_STUB(setAnalogPeriodUs)
+    DAL_STUB(setServoValue)
+    DAL_STUB(setServoPulseUs)
+    DAL_STUB(getDigitalValue)
+    DAL_STUB(setDigitalValue)
+};
+
+class MicroBitButton
+{
+public:
+    DAL_STUB(isPressed)
+};
+
+class MicroBitSerial
+{
+public:
+    int printf(const char *format, ...);
+    int putc(char c);
+    int getc() { return 0; }
+    MicroBitImage readImage(int width, int height) { return MicroBitImage(width, height); }
+    ManagedString readString() { return ManagedString::EmptyString; }
+    DAL_STUB(readDisplayState)
+    DAL_STUB(sendDisplayState)
+    DAL_STUB(sendImage)
+    DAL_STUB(sendString)
+    DAL_STUB(send)
+    DAL_STUB(read)
+};
+
+class MicroBitDisplay
+{
+public:
+    MicroBitImage image;
+
+    MicroBitImage screenShot() { return image.clone(); }
+    int enable() { energy_set(ENERGY_DISPLAY, true); return MICROBIT_OK; }
+    int disable() { energy_set(ENERGY_DISPLAY, false); return MICROBIT_OK; }
+    DAL_STUB(animate)
+    DAL_STUB(clear)
+    DAL_STUB(getBrightness)
+    DAL_STUB(print)
+    DAL_STUB(readLightLevel)
+    DAL_STUB(scroll)
+    DAL_STUB(setBrightness)
+    DAL_STUB(setDisplayMode)
+    DAL_STUB(setErrorTimeout)
+    DAL_STUB(stopAnimation)
+};
+
+class MicroBitIO
+{
+public:
+    MicroBitPin P0, P1, P2, P3, P4, P5, P6, P7, P8, P9, P10,
+                P11, P12, P13, P14, P15, P16, P19, P20;
+};
+
+class MicroBitMessageBus
+{
+public:
+    DAL_STUB(listen)
+    DAL_STUB(ignore)
+};
+
+class MicroBitRadioDatagram
+{
+public:
+    PacketBuffer recv() { return PacketBuffer(); }
+    DAL_STUB(send)
+};
+
+class MicroBitRadioEvent
+{
+public:
+    DAL_STUB(eventReceived)
+};
+
+class MicroBitRadio
+{
+public:
+    MicroBitRadioDatagram datagram;
+    MicroBitRadioEvent event;
+
+    int enable() { energy_set(ENERGY_RADIO, true); return MICROBIT_OK; }
+    int disable() { energy_set(ENERGY_RADIO, false); return MICROBIT_OK; }
+    DAL_STUB(setGroup)
+};
+
+class MicroBitAccelerometer
+{
+public:
+    DAL_SENSOR_STUB(getPitch, ENERGY_ACCELEROMETER)
+    DAL_SENSOR_STUB(getRoll, ENERGY_ACCELEROMETER)
+    DAL_SENSOR_STUB(getX, ENERGY_ACCELEROMETER)
+    DAL_SENSOR_STUB(getY, ENERGY_ACCELEROMETER)
+    DAL_SENSOR_STUB(getZ, ENERGY_ACCELEROMETER)
+};
+
+class MicroBitCompass
+{
+public:
+    DAL_SENSOR_STUB(calibrate, ENERGY_COMPASS)
+    DAL_SENSOR_STUB(getFieldStrength, ENERGY_COMPASS)
+    DAL_SENSOR_STUB(getX, ENERGY_COMPASS)
+    DAL_SENSOR_STUB(getY, ENERGY_COMPASS)
+    DAL_SENSOR_STUB(getZ, ENERGY_COMPASS)
+    DAL_SENSOR_STUB(heading, ENERGY_COMPASS)
+    DAL_SENSOR_STUB(isCalibrated, ENERGY_COMPASS)
+};
+
+class MicroBitI2C
+{
+public:
+    DAL_STUB(read)
+    DAL_STUB(write)
+};
+
+class MicroBitThermometer
+{
+public:
+    DAL_STUB(getTemperature)
+};
+
+class MicroBit
+{
+public:
+    MicroBitSerial serial;
+    MicroBitDisplay display;
+    MicroBitIO io;
+    MicroBitMessageBus MessageBus;
+    MicroBitRadio radio;
+    MicroBitAccelerometer accelerometer;
+    MicroBitCompass compass;
+    MicroBitButton buttonA, buttonB, buttonAB;
+    MicroBitI2C i2c;
+    MicroBitThermometer thermometer;
+
+    int addSystemComponent(MicroBitComponent *component);
+    int addIdleComponent(MicroBitComponent *component);
+    int removeIdleComponent(MicroBitComponent *component);
+    unsigned long systemTime();
+    void sleep(int milliseconds);
+    int random(int max);
+    void panic(int statusCode);
+    void reset();
+};
+
+extern MicroBit uBit;
+
+struct Fiber
+{
+    uint32_t flags;
+};
+
+extern Fiber *currentFiber;
+
+// There is no scheduler: fibers are never started, and waiting runs the idle
+// components, then returns.
+void create_fiber(void (*entry_fn)(void));
+void create_fiber(void (*entry_fn)(void *), void *param, void (*completion_fn)(void *) = NULL);
+void release_fiber();
+void schedule();
+void fiber_sleep(unsigned long t);
+int fiber_wait_for_event(uint16_t id, uint16_t value);
+void wait_ms(int ms);
+void wait_us(int us);
+void microbit_panic(int statusCode);
+
+uint32_t us_ticker_read();
+
+// Not in the DAL: the CPU cycles since reset, from SysTick.
+uint64_t systick_read();
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef MICROBIT_IMAGE_H
+#define MICROBIT_IMAGE_H
+
+// Stand-in for microbit-dal's MicroBitImage.h, for the QEMU benchmarks.
+
+#include "ManagedString.h"
+
+struct ImageData : RefCounted
+{
+    uint8_t width;
+    uint8_t height;
+    uint8_t data[0];
+};
+
+class MicroBitImage
+{
+    ImageData *ptr;
+
+    void init(int width, int height, const uint8_t *bitmap);
+
+public:
+    MicroBitImage();
+    MicroBitImage(ImageData *p);
+    MicroBitImage(const char *s);
+    MicroBitImage(const int x, const int y);
+    MicroBitImage(const int x, const int y, const uint8_t *bitmap);
+    MicroBitImage(const MicroBitImage &image);
+    ~MicroBitImage();
+
+    MicroBitImage& operator=(const MicroBitImage &i);
+
+    ImageData *leakData();
+    MicroBitImage clone();
+    void clear();
+    int setPixelValue(int x, int y, uint8_t value);
+    int getPixelValue(int x, int y);
+    int getWidth() { return ptr->width; }
+    int getHeight() { return ptr->height; }
+};
+
+#endif
@@ -0,0 +1,594 @@
+// Stand-in for the parts of microbit-dal the runtime needs, for the QEMU
+// benchmarks. See MicroBit.h.
+
+#include <stdarg.h>
+#include "MicroBit.h"
+
+MicroBit uBit;
+Fiber *currentFiber;
+
+// ---------------------------------------------------------------------------
+// Clocks. SysTick counts CPU cycles, down from 0xffffff; the wrap-arounds are
+// counted in the interrupt. Under QEMU with -icount, a "cycle" is really a
+// fixed number of instructions (see README.md).
+// ---------------------------------------------------------------------------
+
+#define SYST_CSR (*(volatile uint32_t *)0xE000E010)
+#define SYST_RVR (*(volatile uint32_t *)0xE000E014)
+#define SYST_CVR (*(volatile uint32_t *)0xE000E018)
+
+#define SYST_CSR_ENABLE     (1 << 0)
+#define SYST_CSR_TICKINT    (1 << 1)
+#define SYST_CSR_CLKSOURCE  (1 << 2)
+#define SYST_RELOAD         0xffffff
+
+static volatile uint32_t sysTickWraps;
+
+extern "C" void SysTick_Handler()
+{
+    sysTickWraps++;
+}
+
+static void systick_init()
+{
+    SYST_RVR = SYST_RELOAD;
+    SYST_CVR = 0;
+    SYST_CSR = SYST_CSR_ENABLE | SYST_CSR_TICKINT | SYST_CSR_CLKSOURCE;
+}
+
+uint64_t systick_read()
+{
+    uint32_t wraps, val;
+    // retry if it wrapped around in between
+    do {
+        wraps = sysTickWraps;
+        val = SYST_CVR;
+    } while (wraps != sysTickWraps);
+    return ((uint64_t)wraps << 24) + (SYST_RELOAD - val);
+}
+
+#define CYCLES_PER_US (MICROBIT_CPU_HZ / 1000000)
+
+uint32_t us_ticker_read()
+{
+    return (uint32_t)(systick_read() / CYCLES_PER_US);
+}
+
+void wait_us(int us)
+{
+    uint32_t start = us_ticker_read();
+    while ((int)(us_ticker_read() - start) < us)
+        ;
+}
+
+void wait_ms(int ms)
+{
+    wait_us(ms * 1000);
+}
+
+// ---------------------------------------------------------------------------
+// Energy. The time spent in each EnergyState, and the CPU's time awake, times
+// typical supply currents, gives the charge a run took. The figures are for
+// the nRF51822 and the micro:bit's sensors, and rough; they're for comparing
+// runtime changes with each other, not for predicting battery life.
+// ---------------------------------------------------------------------------
+
+#ifndef ENERGY_UA_CPU
+#define ENERGY_UA_CPU           4400    // running from flash at 16MHz
+#endif
+#ifndef ENERGY_UA_SLEEP
+#define ENERGY_UA_SLEEP         15      // System ON, waiting for an event, a timer running
+#endif
+#ifndef ENERGY_UA_RADIO
+#define ENERGY_UA_RADIO         13000   // receiving at 1Mbps; the DAL listens while enabled
+#endif
+#ifndef ENERGY_UA_DISPLAY
+#define ENERGY_UA_DISPLAY       5000    // refreshing, a few LEDs lit
+#endif
+#ifndef ENERGY_UA_ACCELEROMETER
+#define ENERGY_UA_ACCELEROMETER 165     // MMA8653, active
+#endif
+#ifndef ENERGY_UA_COMPASS
+#define ENERGY_UA_COMPASS       150     // MAG3110, sampling at 10Hz
+#endif
+// While the CPU sleeps, the DAL's system tick still wakes it every
+// ENERGY_TICK_MS, for about ENERGY_TICK_US. Set ENERGY_TICK_MS to 0 to see
+// what tickless idle would gain.
+#ifndef ENERGY_TICK_MS
+#define ENERGY_TICK_MS          6
+#endif
+#ifndef ENERGY_TICK_US
+#define ENERGY_TICK_US          20
+#endif
+#ifndef ENERGY_BATTERY_MAH
+#define ENERGY_BATTERY_MAH      1000    // 2 x AAA alkaline
+#endif
+
+static const char *energyNames[ENERGY_STATES] = {
+    "sleep", "radio", "display", "accelerometer", "compass",
+};
+
+static const uint32_t energyMicroAmps[ENERGY_STATES] = {
+    ENERGY_UA_SLEEP, ENERGY_UA_RADIO, ENERGY_UA_DISPLAY, ENERGY_UA_ACCELEROMETER, ENERGY_UA_COMPASS,
+};
+
+static bool energyOn[ENERGY_STATES];
+static uint64_t energySince[ENERGY_STATES];
+static uint64_t energyCycles[ENERGY_STATES];
+static uint64_t energyStart;
+
+void energy_set(EnergyState state, bool on)
+{
+    if (energyOn[state] == on)
+        return;
+    uint64_t now = systick_read();
+    if (on)
+        energySince[state] = now;
+    else
+        energyCycles[state] += now - energySince[state];
+    energyOn[state] = on;
+}
+
+// Starts the accounting over, from now; what's on stays on.
+void energy_reset()
+{
+    uint64_t now = systick_read();
+    for (int i = 0; i < ENERGY_STATES; ++i) {
+        energyCycles[i] = 0;
+        energySince[i] = now;
+    }
+    energyStart = now;
+}
+
+static uint64_t energyMicros(int state, uint64_t now)
+{
+    uint64_t cycles = energyCycles[state];
+    if (energyOn[state])
+        cycles += now - energySince[state];
+    return cycles / CYCLES_PER_US;
+}
+
+// Returns the charge in nAh.
+static uint32_t energyLine(const char *name, uint64_t us, uint32_t microAmps)
+{
+    uint32_t nAh = (uint32_t)(us * microAmps / 3600000);
+    printf("  %-14s %8lu %8lu %8lu.%03lu\n", name, (unsigned long)(us / 1000),
+           (unsigned long)microAmps, (unsigned long)(nAh / 1000), (unsigned long)(nAh % 1000));
+    return nAh;
+}
+
+// Printed when the program exits.
+void energy_report()
+{
+    uint64_t now = systick_read();
+    uint64_t total = (now - energyStart) / CYCLES_PER_US;
+    uint64_t asleep = energyMicros(ENERGY_SLEEP, now);
+    uint64_t wakeups = ENERGY_TICK_MS ? asleep / (ENERGY_TICK_MS * 1000) : 0;
+    uint64_t tickUs = wakeups * ENERGY_TICK_US;
+    if (tickUs > asleep)
+        tickUs = asleep;
+
+    printf("energy, %lu ms:\n", (unsigned long)(total / 1000));
+    printf("  %-14s %8s %8s %12s\n", "state", "ms", "uA", "uAh");
+    uint32_t nAh = energyLine("cpu", total - asleep + tickUs, ENERGY_UA_CPU);
+    nAh += energyLine("sleep", asleep - tickUs, ENERGY_UA_SLEEP);
+    for (int i = ENERGY_SLEEP + 1; i < ENERGY_STATES; ++i)
+        nAh += energyLine(energyNames[i], energyMicros(i, now), energyMicroAmps[i]);
+
+    if (total == 0)
+        return;
+    uint32_t avg = (uint32_t)((uint64_t)nAh * 3600000 / total);
+    printf("  average %lu uA", (unsigned long)avg);
+    if (avg > 0)
+        printf(", %lu hours on %d mAh", (unsigned long)(ENERGY_BATTERY_MAH * 1000 / avg), ENERGY_BATTERY_MAH);
+    printf("\n");
+}
+
+extern "C" void dal_init()
+{
+    systick_init();
+    // the DAL starts with the display on
+    energy_set(ENERGY_DISPLAY, true);
+    atexit(energy_report);
+}
+
+// ---------------------------------------------------------------------------
+// Scheduler
+// ---------------------------------------------------------------------------
+
+#define MAX_COMPONENTS 10
+
+static MicroBitComponent *systemComponents[MAX_COMPONENTS];
+static MicroBitComponent *idleComponents[MAX_COMPONENTS];
+
+static int addComponent(MicroBitComponent **list, MicroBitComponent *component)
+{
+    for (int i = 0; i < MAX_COMPONENTS; ++i) {
+        if (list[i] == NULL) {
+            list[i] = component;
+            return MICROBIT_OK;
+        }
+    }
+    return -1;
+}
+
+static int removeComponent(MicroBitComponent **list, MicroBitComponent *component)
+{
+    for (int i = 0; i < MAX_COMPONENTS; ++i) {
+        if (list[i] == component) {
+            list[i] = NULL;
+            return MICROBIT_OK;
+        }
+    }
+    return -1;
+}
+
+void schedule()
+{
+    for (int i = 0; i < MAX_COMPONENTS; ++i)
+        if (idleComponents[i])
+            idleComponents[i]->idleTick();
+}
+
+void fiber_sleep(unsigned long t)
+{
+    schedule();
+    energy_set(ENERGY_SLEEP, true);
+    wait_ms(t);
+    energy_set(ENERGY_SLEEP, false);
+}
+
+int fiber_wait_for_event(uint16_t id, uint16_t value)
+{
+    schedule();
+    return MICROBIT_OK;
+}
+
+void create_fiber(void (*entry_fn)(void)) {}
+void create_fiber(void (*entry_fn)(void *), void *param, void (*completion_fn)(void *)) {}
+void release_fiber() {}
+
+void microbit_panic(int statusCode)
+{
+    printf("panic %d\n", statusCode);
+    exit(statusCode);
+}
+
+MicroBitEvent::MicroBitEvent(uint16_t source, uint16_t value, int mode)
+{
+    // nothing listens; see MicroBitMessageBus
+    this->source = source;
+    this->value = value;
+    this->timestamp = uBit.systemTime();
+}
+
+int MicroBit::addSystemComponent(MicroBitComponent *component)
+{
+    return addComponent(systemComponents, component);
+}
+
+int MicroBit::addIdleComponent(MicroBitComponent *component)
+{
+    return addComponent(idleComponents, component);
+}
+
+int MicroBit::removeIdleComponent(MicroBitComponent *component)
+{
+    return removeComponent(idleComponents, component);
+}
+
+unsigned long MicroBit::systemTime()
+{
+    return (unsigned long)(systick_read() / (MICROBIT_CPU_HZ / 1000));
+}
+
+void MicroBit::sleep(int milliseconds)
+{
+    fiber_sleep(milliseconds);
+}
+
+int MicroBit::random(int max)
+{
+    return max <= 0 ? 0 : rand() % max;
+}
+
+void MicroBit::panic(int statusCode)
+{
+    microbit_panic(statusCode);
+}
+
+void MicroBit::reset()
+{
+    exit(0);
+}
+
+// Semihosting; stdout goes to QEMU's.
+int MicroBitSerial::printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int r = vprintf(format, args);
+    va_end(args);
+    return r;
+}
+
+int MicroBitSerial::putc(char c)
+{
+    return putchar(c);
+}
+
+// ---------------------------------------------------------------------------
+// RefCounted, ManagedString and MicroBitImage, as in the DAL.
+// ---------------------------------------------------------------------------
+
+#define REF_READ_ONLY 0xffff
+
+void RefCounted::init()
+{
+    refCount = 3;
+}
+
+bool RefCounted::isReadOnly()
+{
+    if (refCount == REF_READ_ONLY)
+        return true;
+    if (refCount == 0 || (refCount & 1) == 0)
+        microbit_panic(30); // MICROBIT_HEAP_ERROR
+    return false;
+}
+
+void RefCounted::incr()
+{
+    if (!isReadOnly())
+        refCount += 2;
+}
+
+void RefCounted::decr()
+{
+    if (isReadOnly())
+        return;
+    refCount -= 2;
+    if (refCount == 1)
+        free(this);
+}
+
+static const char emptyStringData[] __attribute__((aligned(4))) = "\xff\xff\0\0\0";
+
+ManagedString ManagedString::EmptyString((StringData *)(void *)emptyStringData);
+
+void ManagedString::initEmpty()
+{
+    ptr = (StringData *)(void *)emptyStringData;
+}
+
+void ManagedString::initString(const char *str, int length)
+{
+    ptr = (StringData *)malloc(sizeof(StringData) + length + 1);
+    ptr->init();
+    ptr->len = length;
+    if (str)
+        memcpy(ptr->data, str, length);
+    ptr->data[length] = 0;
+}
+
+ManagedString::ManagedString()
+{
+    initEmpty();
+}
+
+ManagedString::ManagedString(const char *str)
+{
+    if (str == NULL || *str == 0)
+        initEmpty();
+    else
+        initString(str, strlen(str));
+}
+
+ManagedString::ManagedString(const char *str, const int16_t length)
+{
+    if (str == NULL || length <= 0)
+        initEmpty();
+    else
+        initString(str, length);
+}
+
+ManagedString::ManagedString(const int value)
+{
+    char buf[12];
+    snprintf(buf, sizeof(buf), "%d", value);
+    initString(buf, strlen(buf));
+}
+
+ManagedString::ManagedString(const char value)
+{
+    initString(&value, 1);
+}
+
+ManagedString::ManagedString(StringData *p)
+{
+    ptr = p;
+    ptr->incr();
+}
+
+ManagedString::ManagedString(const ManagedString &s)
+{
+    ptr = s.ptr;
+    ptr->incr();
+}
+
+ManagedString::~ManagedString()
+{
+    ptr->decr();
+}
+
+ManagedString& ManagedString::operator=(const ManagedString &s)
+{
+    if (ptr != s.ptr) {
+        ptr->decr();
+        ptr = s.ptr;
+        ptr->incr();
+    }
+    return *this;
+}
+
+ManagedString ManagedString::operator+(const ManagedString &s)
+{
+    if (s.ptr->len == 0)
+        return *this;
+    if (ptr->len == 0)
+        return s;
+
+    ManagedString r;
+    r.initString(NULL, ptr->len + s.ptr->len);
+    memcpy(r.ptr->data, ptr->data, ptr->len);
+    memcpy(r.ptr->data + ptr->len, s.ptr->data, s.ptr->len);
+    return r;
+}
+
+bool ManagedString::operator==(const ManagedString &s)
+{
+    return ptr->len == s.ptr->len && memcmp(ptr->data, s.ptr->data, ptr->len) == 0;
+}
+
+StringData *ManagedString::leakData()
+{
+    StringData *r = ptr;
+    initEmpty();
+    return r;
+}
+
+ManagedString ManagedString::substring(int start, int length)
+{
+    if (start < 0 || length <= 0 || start >= ptr->len)
+        return ManagedString();
+    if (length > ptr->len - start)
+        length = ptr->len - start;
+    return ManagedString(ptr->data + start, (int16_t)length);
+}
+
+char ManagedString::charAt(int index)
+{
+    return 0 <= index && index < ptr->len ? ptr->data[index] : 0;
+}
+
+static const uint8_t emptyImageData[] __attribute__((aligned(4))) = { 0xff, 0xff, 0, 0 };
+
+void MicroBitImage::init(int width, int height, const uint8_t *bitmap)
+{
+    ptr = (ImageData *)malloc(sizeof(ImageData) + width * height);
+    ptr->init();
+    ptr->width = width;
+    ptr->height = height;
+    if (bitmap)
+        memcpy(ptr->data, bitmap, width * height);
+    else
+        memset(ptr->data, 0, width * height);
+}
+
+MicroBitImage::MicroBitImage()
+{
+    ptr = (ImageData *)(void *)emptyImageData;
+}
+
+MicroBitImage::MicroBitImage(ImageData *p)
+{
+    ptr = p;
+    ptr->incr();
+}
+
+// "0,255,0\n255,0,255\n": comma separated pixels, one row per line.
+MicroBitImage::MicroBitImage(const char *s)
+{
+    int width = 0, height = 0, count = 0;
+    for (const char *p = s; *p; ++p) {
+        if (*p == ',')
+            count++;
+        if (*p == '\n') {
+            if (width == 0)
+                width = count + 1;
+            count = 0;
+            height++;
+        }
+    }
+    init(width, height, NULL);
+    int x = 0, y = 0, v = 0;
+    for (const char *p = s; *p && y < height; ++p) {
+        if ('0' <= *p && *p <= '9') {
+            v = v * 10 + *p - '0';
+        } else {
+            if (x < width)
+                ptr->data[y * width + x] = v;
+            v = 0;
+            if (*p == ',') {
+                x++;
+            } else if (*p == '\n') {
+                x = 0;
+                y++;
+            }
+        }
+    }
+}
+
+MicroBitImage::MicroBitImage(const int x, const int y)
+{
+    init(x, y, NULL);
+}
+
+MicroBitImage::MicroBitImage(const int x, const int y, const uint8_t *bitmap)
+{
+    init(x, y, bitmap);
+}
+
+MicroBitImage::MicroBitImage(const MicroBitImage &image)
+{
+    ptr = image.ptr;
+    ptr->incr();
+}
+
+MicroBitImage::~MicroBitImage()
+{
+    ptr->decr();
+}
+
+MicroBitImage& MicroBitImage::operator=(const MicroBitImage &i)
+{
+    if (ptr != i.ptr) {
+        ptr->decr();
+        ptr = i.ptr;
+        ptr->incr();
+    }
+    return *this;
+}
+
+ImageData *MicroBitImage::leakData()
+{
+    ImageData *r = ptr;
+    ptr = (ImageData *)(void *)emptyImageData;
+    return r;
+}
+
+MicroBitImage MicroBitImage::clone()
+{
+    return MicroBitImage(ptr->width, ptr->height, ptr->data);
+}
+
+void MicroBitImage::clear()
+{
+    if (!ptr->isReadOnly())
+        memset(ptr->data, 0, ptr->width * ptr->height);
+}
+
+int MicroBitImage::setPixelValue(int x, int y, uint8_t value)
+{
+    if (x < 0 || y < 0 || x >= ptr->width || y >= ptr->height || ptr->isReadOnly())
+        return -1001; // MICROBIT_INVALID_PARAMETER
+    ptr->data[y * ptr->width + x] = value;
+    return MICROBIT_OK;
+}
+
+int MicroBitImage::getPixelValue(int x, int y)
+{
+    if (x < 0 || y < 0 || x >= ptr->width || y >= ptr->height)
+        return -1001;
+    return ptr->data[y * ptr->width + x];
+}
@@ -0,0 +1,31 @@
+#ifndef NRF51_H
+#define NRF51_H
+
+// The parts of the nRF51 register map the runtime uses (mbed.h brings in the
+// real nrf51.h on the device). QEMU's microbit machine models both blocks.
+
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t RESERVED0[4];
+    volatile uint32_t CODEPAGESIZE;     // 0x010
+    volatile uint32_t CODESIZE;         // 0x014, in pages
+} NRF_FICR_Type;
+
+typedef struct {
+    volatile uint32_t RESERVED0[256];
+    volatile uint32_t READY;            // 0x400
+    volatile uint32_t RESERVED1[64];
+    volatile uint32_t CONFIG;           // 0x504
+    volatile uint32_t ERASEPAGE;        // 0x508
+} NRF_NVMC_Type;
+
+#define NRF_FICR ((NRF_FICR_Type *)0x10000000)
+#define NRF_NVMC ((NRF_NVMC_Type *)0x4001E000)
+
+#define NVMC_READY_READY_Busy 0
+#define NVMC_CONFIG_WEN_Ren 0
+#define NVMC_CONFIG_WEN_Wen 1
+#define NVMC_CONFIG_WEN_Een 2
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef NRF_SDM_H
+#define NRF_SDM_H
+
+// The SoftDevice is never enabled under QEMU.
+
+#include <stdint.h>
+
+#ifndef NRF_SUCCESS
+#define NRF_SUCCESS 0
+#endif
+
+static inline uint32_t sd_softdevice_is_enabled(uint8_t *enabled)
+{
+    *enabled = 0;
+    return NRF_SUCCESS;
+}
+
+static inline uint32_t sd_softdevice_disable()
+{
+    return NRF_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,60 @@
+// Vector table and reset handler for the QEMU benchmarks; see nrf51.ld. The C
+// library comes from newlib, with rdimon for semihosting.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern "C" {
+    extern uint32_t __etext, __data_start__, __data_end__, __bss_start__, __bss_end__, __StackTop;
+
+    void initialise_monitor_handles();
+    void __libc_init_array();
+    void dal_init();
+    void SysTick_Handler();
+    int main();
+
+    // Called by __libc_init_array(); there's no crti.o with -nostartfiles.
+    void _init() {}
+
+    void Reset_Handler()
+    {
+        uint32_t *src = &__etext;
+        for (uint32_t *dst = &__data_start__; dst < &__data_end__; )
+            *dst++ = *src++;
+        for (uint32_t *dst = &__bss_start__; dst < &__bss_end__; )
+            *dst++ = 0;
+
+        initialise_monitor_handles();
+        dal_init();
+        __libc_init_array();
+        exit(main());
+    }
+
+    void HardFault_Handler()
+    {
+        printf("hard fault\n");
+        exit(3);
+    }
+
+    void Default_Handler()
+    {
+        printf("unexpected interrupt\n");
+        exit(3);
+    }
+}
+
+typedef void (*Vector)();
+
+__attribute__((section(".vectors"), used))
+const Vector vectors[16] = {
+    (Vector)&__StackTop,
+    Reset_Handler,
+    Default_Handler,    // NMI
+    HardFault_Handler,
+    0, 0, 0, 0, 0, 0, 0,
+    Default_Handler,    // SVCall
+    0, 0,
+    Default_Handler,    // PendSV
+    SysTick_Handler,
+};
@@ -0,0 +1,291 @@
+"use strict";
+
+if (process.argv.length < 3) {
+  console.log("Replay an allocation trace (BITVM_ALLOC_TRACE) against candidate allocators.")
+  console.log("USAGE: node allocsim.js trace.bin [heap-size-in-bytes]")
+  process.exit(1)
+}
+
+var fs = require('fs');
+
+var kinds = ["free", "record", "action", "collection", "string", "buffer", "local", "stopwatch", "payload", "env"]
+// What doesn't go through allocRef(), and so never into the pool: DAL strings,
+// and the element storage of collections and buffers.
+var heapOnly = { string: 1, payload: 1 }
+
+// Decode the serial capture; see "Allocation trace" in source/bitvm.cpp.
+function parseTrace(buf) {
+    var pos = 0
+    var hdr = buf.indexOf("BVAT\x01")
+    if (hdr < 0) {
+        console.log("no trace header found")
+        process.exit(1)
+    }
+    pos = hdr + 5
+
+    function varint() {
+        var v = 0, shift = 0
+        while (pos < buf.length) {
+            var b = buf[pos++]
+            v += (b & 0x7f) * Math.pow(2, shift)
+            shift += 7
+            if (!(b & 0x80))
+                return v
+        }
+        return -1
+    }
+
+    var events = []
+    var time = 0
+    var skipped = 0
+    while (pos < buf.length) {
+        var op = buf[pos++]
+        if ((op & 0xf0) != 0xf0 || (op & 0xf) >= kinds.length) {
+            skipped++; // stray serial output; resynchronize on the next event byte
+            continue
+        }
+        var kind = op & 0xf
+        var dt = varint()
+        var addr = varint()
+        var size = kind ? varint() : 0
+        if (size < 0)
+            break
+        time += dt
+        events.push({ kind: kind, time: time, addr: addr, size: size })
+    }
+    if (skipped)
+        console.log("skipped " + skipped + " stray bytes")
+    return events
+}
+
+// Turn the trace into alloc/free operations on object ids. The DAL frees
+// strings itself, so these frees are not traced; a new allocation at the
+// address of a live object implies the older one was freed before.
+function toOps(events) {
+    var live = {}
+    var ops = []
+    var nextId = 1
+    var implicit = 0
+    events.forEach(e => {
+        if (e.kind == 0) {
+            if (live[e.addr]) {
+                ops.push({ free: live[e.addr] })
+                delete live[e.addr]
+            }
+        } else {
+            if (live[e.addr]) {
+                ops.push({ free: live[e.addr] })
+                implicit++
+            }
+            live[e.addr] = nextId
+            ops.push({ alloc: nextId++, size: e.size, kind: e.kind })
+        }
+    })
+    return { ops: ops, implicitFrees: implicit }
+}
+
+// A newlib-style heap: 4 byte header, 8 byte alignment, address-ordered free
+// list with coalescing, and a break that only grows.
+function FreeListHeap(limit, bestFit) {
+    this.limit = limit
+    this.bestFit = bestFit
+    this.brk = 0
+    this.free = [] // { start, size }, sorted by start
+    this.inUse = 0
+}
+
+FreeListHeap.prototype.alloc = function (size) {
+    var need = (size + 4 + 7) & ~7
+    var idx = -1
+    for (var i = 0; i < this.free.length; ++i) {
+        if (this.free[i].size >= need) {
+            if (!this.bestFit) {
+                idx = i
+                break
+            }
+            if (idx < 0 || this.free[i].size < this.free[idx].size)
+                idx = i
+        }
+    }
+    var start
+    if (idx >= 0) {
+        var b = this.free[idx]
+        start = b.start
+        if (b.size - need >= 16) {
+            b.start += need
+            b.size -= need
+        } else {
+            need = b.size
+            this.free.splice(idx, 1)
+        }
+    } else {
+        if (this.brk + need > this.limit)
+            return null
+        start = this.brk
+        this.brk += need
+    }
+    this.inUse += need
+    return { start: start, size: need }
+}
+
+FreeListHeap.prototype.release = function (blk) {
+    this.inUse -= blk.size
+    var i = 0
+    while (i < this.free.length && this.free[i].start < blk.start)
+        i++
+    this.free.splice(i, 0, { start: blk.start, size: blk.size })
+    var next = this.free[i + 1]
+    if (next && blk.start + blk.size == next.start) {
+        this.free[i].size += next.size
+        this.free.splice(i + 1, 1)
+    }
+    var prev = this.free[i - 1]
+    if (prev && prev.start + prev.size == this.free[i].start) {
+        prev.size += this.free[i].size
+        this.free.splice(i, 1)
+    }
+}
+
+FreeListHeap.prototype.footprint = function () {
+    return this.brk
+}
+
+FreeListHeap.prototype.freeBlocks = function () {
+    var gap = this.limit - this.brk
+    return this.free.map(b => b.size).concat(gap > 0 ? [gap] : [])
+}
+
+// The runtime's object pool (see "Object pool" in source/bitvm.cpp): one
+// region of 128 byte pages, each holding a single size class, in front of a
+// general heap for strings, element storage, objects over 64 bytes and
+// whatever doesn't fit. The scratch arena isn't modelled.
+function SegregatedHeap(limit, poolSize) {
+    this.classes = [8, 12, 16, 20, 24, 28, 32, 40, 48, 64]
+    this.pageSize = 128
+    this.pages = []
+    for (var i = 0; i < poolSize / this.pageSize; ++i)
+        this.pages.push({ cls: -1, used: 0, free: [] })
+    this.poolSize = poolSize
+    this.heap = new FreeListHeap(limit - poolSize, false)
+}
+
+SegregatedHeap.prototype.alloc = function (size, kind) {
+    size = (size + 3) & ~3 // as allocRef() does
+    var cls = heapOnly[kinds[kind]] ? -1 : this.classes.findIndex(c => c >= size)
+    if (cls >= 0) {
+        var pg = this.pages.find(p => p.cls == cls && p.free.length > 0)
+        if (!pg) {
+            pg = this.pages.find(p => p.cls < 0)
+            if (pg) {
+                pg.cls = cls
+                pg.free = []
+                for (var j = Math.floor(this.pageSize / this.classes[cls]) - 1; j >= 0; --j)
+                    pg.free.push(j)
+            }
+        }
+        if (pg) {
+            pg.used++
+            return { page: pg, slot: pg.free.pop() }
+        }
+    }
+    var b = this.heap.alloc(size)
+    return b ? { heap: b } : null
+}
+
+SegregatedHeap.prototype.release = function (blk) {
+    if (blk.heap)
+        return this.heap.release(blk.heap)
+    var pg = blk.page
+    pg.free.push(blk.slot)
+    if (--pg.used == 0)
+        pg.cls = -1
+}
+
+SegregatedHeap.prototype.footprint = function () {
+    return this.poolSize + this.heap.footprint()
+}
+
+SegregatedHeap.prototype.freeBlocks = function () {
+    var blocks = this.heap.freeBlocks()
+    var run = 0
+    this.pages.forEach(p => {
+        if (p.cls < 0) {
+            run += this.pageSize
+        } else {
+            if (run) blocks.push(run)
+            run = 0
+        }
+    })
+    if (run) blocks.push(run)
+    return blocks
+}
+
+function fragmentation(heap) {
+    var blocks = heap.freeBlocks()
+    var total = blocks.reduce((a, b) => a + b, 0)
+    if (total == 0)
+        return 0
+    return Math.round(100 - Math.max.apply(null, blocks) * 100 / total)
+}
+
+function simulate(name, heap, ops) {
+    var live = {}
+    var peak = 0, peakFrag = 0, failures = 0
+    var start = process.hrtime()
+    ops.forEach(op => {
+        if (op.free) {
+            if (live[op.free])
+                heap.release(live[op.free])
+            delete live[op.free]
+        } else {
+            var b = heap.alloc(op.size, op.kind)
+            if (!b) {
+                failures++
+                return
+            }
+            live[op.alloc] = b
+            if (heap.footprint() > peak) {
+                peak = heap.footprint()
+                peakFrag = fragmentation(heap)
+            }
+        }
+    })
+    var t = process.hrtime(start)
+    var secs = t[0] + t[1] / 1e9
+    return {
+        name: name,
+        peak: peak,
+        peakFrag: peakFrag,
+        finalFrag: fragmentation(heap),
+        failures: failures,
+        opsPerSec: Math.round(ops.length / (secs || 1e-9)),
+    }
+}
+
+var heapSize = parseInt(process.argv[3] || "16384")
+var events = parseTrace(fs.readFileSync(process.argv[2]))
+var conv = toOps(events)
+var ops = conv.ops
+
+var perKind = {}
+events.forEach(e => perKind[kinds[e.kind]] = (perKind[kinds[e.kind]] || 0) + 1)
+console.log("events: " + events.length + " " + JSON.stringify(perKind))
+console.log("implicit string frees: " + conv.implicitFrees)
+console.log("trace duration: " + (events.length ? events[events.length - 1].time / 1000 : 0) + "ms")
+console.log("")
+
+var results = [
+    simulate("first-fit", new FreeListHeap(heapSize, false), ops),
+    simulate("best-fit", new FreeListHeap(heapSize, true), ops),
+    simulate("segregated 2k", new SegregatedHeap(heapSize, 2048), ops),
+    simulate("segregated 3k", new SegregatedHeap(heapSize, 3072), ops),
+    simulate("segregated 4k", new SegregatedHeap(heapSize, 4096), ops),
+]
+
+var fmt = (s, n) => (s + "                    ").slice(0, n)
+console.log(fmt("allocator", 16) + fmt("peak heap", 12) + fmt("frag@peak", 12) + fmt("frag@end", 12) + fmt("failed", 8) + "ops/sec")
+results.forEach(r => {
+    console.log(fmt(r.name, 16) + fmt(r.peak, 12) + fmt(r.peakFrag + "%", 12) + fmt(r.finalFrag + "%", 12) + fmt(r.failures, 8) + r.opsPerSec)
+})
+
+// vim: ts=4 sw=4
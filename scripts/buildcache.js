@@ -0,0 +1,320 @@
+"use strict";
+
+if (process.argv.length < 4 || !/^(serve|build)$/.test(process.argv[2])) {
+  console.log("Local, offline stand-in for the cloud extension compiler, with a hex cache.")
+  console.log("USAGE: node buildcache.js serve port")
+  console.log("       node buildcache.js build sets.json")
+  process.exit(1)
+}
+
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var http = require('http');
+var crypto = require('crypto');
+var child_process = require('child_process');
+var flashimage = require('./flashimage');
+
+var root = path.resolve(__dirname, "..")
+var cacheDir = process.env.BUILDCACHE_DIR || path.join(root, "build", "cache")
+var buildCmd = process.env.BUILDCACHE_CMD || "yotta build"
+var numWorkers = parseInt(process.env.BUILDCACHE_JOBS || "0") || os.cpus().length
+var editorKeys = process.env.BUILDCACHE_KEY == "editor"
+var hexFile = "build/bbc-microbit-classic-gcc/source/microbit-touchdevelop-combined.hex"
+
+// What goes into a build besides the extensions. Their contents stand in for
+// the runtime version in the cache key, unless BUILDCACHE_KEY=editor.
+var runtimeFiles = ["module.json", "config.json", "source", "microbit-touchdevelop", "generated/pointers.inc"]
+// Not copied to the work directories; linked instead, where present. A
+// worker that has to fetch extra dependencies swaps the links for copies of
+// its own first, as "yotta update" writes into them.
+var linked = ["yotta_modules", "yotta_targets"]
+
+function sha256(s) {
+    return crypto.createHash("sha256").update(s).digest("hex")
+}
+
+function listFiles(p) {
+    if (fs.statSync(p).isDirectory())
+        return [].concat.apply([], fs.readdirSync(p).sort().map(f => listFiles(path.join(p, f))))
+    return [p]
+}
+
+var runtimeVersion = JSON.parse(fs.readFileSync(path.join(root, "module.json"), "utf8")).version
+
+var runtimeHash = sha256(runtimeFiles
+    .map(f => listFiles(path.join(root, f)))
+    .reduce((a, b) => a.concat(b), [])
+    .map(f => path.relative(root, f) + "\n" + sha256(fs.readFileSync(f)))
+    .join("\n"))
+
+function sortKeys(o) {
+    var r = {}
+    Object.keys(o || {}).sort().forEach(k => r[k] = o[k])
+    return r
+}
+
+// An extension set is { sources: [ "glue.cpp contents", ... ], glue: { dependencies, config } }.
+// The order of the extensions doesn't matter, so the same set used by
+// different scripts is only built once. The editor keeps them in the order
+// the script uses them, so editor keys do too.
+function normalize(set) {
+    var glue = set.glue || {}
+    var sources = (set.sources || []).map(s => s.replace(/\r\n/g, "\n"))
+    return {
+        sources: editorKeys ? sources : sources.sort(),
+        dependencies: sortKeys(glue.dependencies),
+        config: sortKeys(glue.config),
+    }
+}
+
+// By default the key covers the runtime sources as they are on disk, so that
+// local changes to the runtime get rebuilt. With BUILDCACHE_KEY=editor it is
+// the one the editor and the cloud service name hex files by (see
+// EXTENSIONS.md): the runtime version number, the extensions and their
+// configuration. Hex files can then go between this cache and theirs, but
+// runtime changes need a version bump to be picked up.
+function cacheKey(set) {
+    if (editorKeys)
+        return sha256(JSON.stringify({
+            version: runtimeVersion,
+            sources: set.sources,
+            dependencies: set.dependencies,
+            config: set.config,
+        }))
+    return sha256(runtimeHash + "\n" + JSON.stringify(set))
+}
+
+// See "Extension structure" in EXTENSIONS.md: one namespace per extension.
+// Returns { name, atomic, pure } for each GLUE function, with the ATOMIC and
+// PURE markers read the way functionTable.js reads them for the runtime.
+function glueFunctions(src) {
+    var m = /^\s*namespace\s+(\w+)/m.exec(src)
+    if (!m)
+        throw new Error("extension has no namespace")
+    var ns = m[1]
+    var funs = []
+    src.split(/\n/).forEach(ln => {
+        var f = /^\s*GLUE\s+(((ATOMIC|PURE)\s+)*)[\w:]+[\s\*\&]+(\w+)\s*\(/.exec(ln)
+        if (f) {
+            var inf = { name: ns + "::" + f[4] }
+            if (/ATOMIC|PURE/.test(f[1]))
+                inf.atomic = true
+            if (/PURE/.test(f[1]))
+                inf.pure = true
+            funs.push(inf)
+        }
+    })
+    return funs
+}
+
+function extFunctions(set) {
+    return set.sources
+        .map(glueFunctions)
+        .reduce((a, b) => a.concat(b), [])
+}
+
+function generatedFiles(set) {
+    var files = {}
+    files["generated/extensions.inc"] = "/* Generated by scripts/buildcache.js */\n" +
+        set.sources.map((s, i) => "// extension " + i + "\n" + s + "\n").join("")
+    files["generated/extpointers.inc"] = extFunctions(set)
+        .map(f => "(uint32_t)(void*)::" + f.name + ",\n")
+        .join("")
+    files["generated/extconfig.h"] = "/* Generated by scripts/buildcache.js */\n" +
+        Object.keys(set.config).map(k => "#undef " + k + "\n#define " + k + " " + set.config[k] + "\n").join("")
+    var mod = JSON.parse(fs.readFileSync(path.join(root, "module.json"), "utf8"))
+    Object.keys(set.dependencies).forEach(k => mod.dependencies[k] = set.dependencies[k])
+    files["module.json"] = JSON.stringify(mod, null, 2) + "\n"
+    return files
+}
+
+// Each worker builds in a copy of the tree of its own, so that yotta builds
+// can run side by side.
+function Worker(id) {
+    this.dir = path.join(cacheDir, "work", "" + id)
+    fs.rmSync(this.dir, { recursive: true, force: true })
+    fs.mkdirSync(this.dir, { recursive: true })
+    fs.readdirSync(root).forEach(f => {
+        if (f == "build" || f == ".git")
+            return
+        if (linked.indexOf(f) >= 0)
+            fs.symlinkSync(path.join(root, f), path.join(this.dir, f))
+        else
+            fs.cpSync(path.join(root, f), path.join(this.dir, f), { recursive: true })
+    })
+    this.ownModules = false
+}
+
+Worker.prototype.copyModules = function () {
+    linked.forEach(f => {
+        var p = path.join(this.dir, f)
+        if (fs.existsSync(p)) {
+            fs.unlinkSync(p)
+            fs.cpSync(path.join(root, f), p, { recursive: true })
+        }
+    })
+    this.ownModules = true
+}
+
+Worker.prototype.build = function (job, done) {
+    var files = generatedFiles(job.set)
+    Object.keys(files).forEach(f => fs.writeFileSync(path.join(this.dir, f), files[f]))
+    fs.rmSync(path.join(this.dir, hexFile), { force: true })
+
+    // Only dependencies that aren't in yotta_modules yet need fetching, which
+    // doesn't work offline unless they're in yotta's cache already. Modules
+    // left over from an earlier set don't get in the way of the build.
+    var missing = Object.keys(job.set.dependencies)
+        .filter(k => !fs.existsSync(path.join(this.dir, "yotta_modules", k)))
+    if (missing.length > 0 && !this.ownModules)
+        this.copyModules()
+    var cmd = missing.length > 0 ? "yotta update && " + buildCmd : buildCmd
+
+    var start = Date.now()
+    child_process.exec(cmd, { cwd: this.dir, maxBuffer: 64 * 1024 * 1024 }, (err, stdout, stderr) => {
+        var log = stdout + stderr
+        var hex = path.join(this.dir, hexFile)
+        if (!err && fs.existsSync(hex)) {
+            // The hex goes last: once it's there, the entry counts as cached.
+            fs.writeFileSync(path.join(cacheDir, job.key + ".json"),
+                JSON.stringify({ functions: extFunctions(job.set) }, null, 2) + "\n")
+            var tmp = path.join(cacheDir, job.key + ".tmp")
+            fs.copyFileSync(hex, tmp)
+            fs.renameSync(tmp, path.join(cacheDir, job.key + ".hex"))
+            // Editors holding the base runtime image only need the difference.
+            var base = path.join(root, "build", "runtime.bin")
+            if (fs.existsSync(base))
+                fs.writeFileSync(path.join(cacheDir, job.key + ".bvd"),
+                    flashimage.makeDelta(fs.readFileSync(base), flashimage.parseHex(fs.readFileSync(hex, "utf8"))))
+            done(null, { key: job.key, cached: false, ms: Date.now() - start })
+        } else {
+            fs.writeFileSync(path.join(cacheDir, job.key + ".log"), log)
+            done(new Error("build failed, see " + job.key + ".log"))
+        }
+    })
+}
+
+var workers = []
+var idleWorkers = []
+var queue = []
+var inflight = {}
+
+function schedule() {
+    while (queue.length > 0 && (idleWorkers.length > 0 || workers.length < numWorkers)) {
+        var w = idleWorkers.pop()
+        if (!w) {
+            w = new Worker(workers.length)
+            workers.push(w)
+        }
+        var job = queue.shift()
+        w.build(job, ((w, job) => (err, res) => {
+            idleWorkers.push(w)
+            job.done(err, res)
+            schedule()
+        })(w, job))
+    }
+}
+
+// Returns a promise of { key, cached, ms }; the hex is in cacheDir/key.hex.
+// Requests for a set that is being built already wait for that build.
+function compile(set) {
+    set = normalize(set)
+    var key = cacheKey(set)
+    if (fs.existsSync(path.join(cacheDir, key + ".hex")))
+        return Promise.resolve({ key: key, cached: true, ms: 0 })
+    try {
+        set.sources.forEach(glueFunctions)
+    } catch (e) {
+        return Promise.reject(e)
+    }
+    if (!inflight[key]) {
+        inflight[key] = new Promise((resolve, reject) => {
+            queue.push({ key: key, set: set, done: (err, res) => err ? reject(err) : resolve(res) })
+            schedule()
+        })
+        var clear = () => delete inflight[key]
+        inflight[key].then(clear, clear)
+    }
+    return inflight[key]
+}
+
+function readHex(key) {
+    return fs.readFileSync(path.join(cacheDir, key + ".hex"), "utf8")
+}
+
+// The extensions' GLUE functions, with their ATOMIC/PURE flags, as in
+// metainfo.json for the runtime's own functions.
+function readFunctions(key) {
+    var fn = path.join(cacheDir, key + ".json")
+    return fs.existsSync(fn) ? JSON.parse(fs.readFileSync(fn, "utf8")).functions : null
+}
+
+// POST /compile with an extension set as JSON returns { hash, cached, hex,
+// functions }; GET /hex/<hash> returns a hex built earlier, and GET /delta/<hash> its
+// delta against build/runtime.bin (see flashimage.js).
+function serve(port) {
+    http.createServer((req, res) => {
+        var reply = (code, obj) => {
+            res.writeHead(code, { "Content-Type": "application/json" })
+            res.end(JSON.stringify(obj))
+        }
+        var m = /^\/(hex|delta)\/([0-9a-f]{64})$/.exec(req.url)
+        if (req.method == "GET" && m) {
+            var fn = path.join(cacheDir, m[2] + (m[1] == "hex" ? ".hex" : ".bvd"))
+            if (!fs.existsSync(fn))
+                return reply(404, { error: "not found" })
+            res.writeHead(200, { "Content-Type": m[1] == "hex" ? "text/plain" : "application/octet-stream" })
+            return res.end(fs.readFileSync(fn))
+        }
+        if (req.method != "POST" || req.url != "/compile")
+            return reply(404, { error: "not found" })
+        var body = ""
+        req.on("data", d => body += d)
+        req.on("end", () => {
+            var set
+            try {
+                set = JSON.parse(body)
+            } catch (e) {
+                return reply(400, { error: "bad JSON" })
+            }
+            compile(set).then(r => {
+                console.log(r.key + (r.cached ? " cached" : " built in " + r.ms + "ms"))
+                reply(200, { hash: r.key, cached: r.cached, hex: readHex(r.key), functions: readFunctions(r.key) })
+            }, e => {
+                console.log(e.message)
+                reply(500, { error: e.message })
+            })
+        })
+    }).listen(port, "127.0.0.1")
+    console.log("runtime " + (editorKeys ? "version " + runtimeVersion : runtimeHash.slice(0, 12)) + ", " + numWorkers + " workers, listening on port " + port)
+}
+
+// sets.json is a list of { sources: [ "file.cpp", ... ], glue: "glue.json" },
+// paths relative to sets.json.
+function buildAll(fn) {
+    var dir = path.dirname(fn)
+    var sets = JSON.parse(fs.readFileSync(fn, "utf8")).map(s => ({
+        sources: (s.sources || []).map(f => fs.readFileSync(path.join(dir, f), "utf8")),
+        glue: s.glue ? JSON.parse(fs.readFileSync(path.join(dir, s.glue), "utf8")) : {},
+    }))
+    var start = Date.now()
+    var failed = 0
+    Promise.all(sets.map((s, i) => compile(s).then(r => {
+        console.log("set " + i + ": " + r.key + (r.cached ? " cached" : " built in " + r.ms + "ms"))
+    }, e => {
+        failed++
+        console.log("set " + i + ": " + e.message)
+    }))).then(() => {
+        console.log(sets.length + " sets in " + (Date.now() - start) + "ms")
+        process.exit(failed ? 1 : 0)
+    })
+}
+
+fs.mkdirSync(cacheDir, { recursive: true })
+if (process.argv[2] == "serve")
+    serve(parseInt(process.argv[3]))
+else
+    buildAll(process.argv[3])
+
+// vim: ts=4 sw=4
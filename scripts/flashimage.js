@@ -0,0 +1,374 @@
+"use strict";
+
+// Binary flash images, and deltas between them, as a compact alternative to
+// shipping Intel hex files to the editor.
+//
+// An image (.bin) is, all numbers 32 bit little endian:
+//
+//   "BVIM" version=1 functionsAddr startType startValue numRegions
+//   { addr length } * numRegions
+//   region data, each padded to a multiple of 4 bytes
+//
+// functionsAddr is the address of bitvm::functionsAndBytecode (found by its
+// magic header), or 0xffffffff. startType is the Intel hex start address
+// record type (3 or 5) with startValue its contents, or 0.
+//
+// A delta (.bvd) turns one image (the base runtime) into another (the
+// runtime built with extensions):
+//
+//   "BVDL" version=1 sha256(base image file) functionsAddr startType startValue
+//   numRegions { addr length } * numRegions
+//   numPatches { addr length data(padded to 4) } * numPatches
+//
+// The regions are those of the target; bytes not covered by a patch are the
+// base's at the same address, or 0xff where the base has none.
+
+var fs = require('fs');
+var crypto = require('crypto');
+
+var MAGIC = [0x08010801, 0x42424242, 0x08010801, 0x8de9d83e]
+
+function Image() {
+    this.regions = [] // { addr, data: Buffer }, sorted by addr
+    this.functionsAddr = 0xffffffff
+    this.startType = 0
+    this.startValue = 0
+}
+
+Image.prototype.findMagic = function () {
+    var m = Buffer.alloc(16)
+    MAGIC.forEach((w, i) => m.writeUInt32LE(w, i * 4))
+    for (var r of this.regions) {
+        var idx = r.data.indexOf(m)
+        if (idx >= 0 && (r.addr + idx) % 4 == 0)
+            return r.addr + idx
+    }
+    return 0xffffffff
+}
+
+// Writes [data] at [addr], growing or adding a region as needed.
+Image.prototype.write = function (addr, data) {
+    var r = this.regions.find(r => r.addr <= addr && addr <= r.addr + r.data.length)
+    if (!r) {
+        r = { addr: addr, data: Buffer.alloc(0) }
+        this.regions.push(r)
+        this.regions.sort((a, b) => a.addr - b.addr)
+    }
+    var end = addr + data.length - r.addr
+    if (end > r.data.length) {
+        var grown = Buffer.alloc(end, 0xff)
+        r.data.copy(grown)
+        r.data = grown
+    }
+    data.copy(r.data, addr - r.addr)
+    this.merge()
+}
+
+// Joins regions that touch.
+Image.prototype.merge = function () {
+    var out = []
+    this.regions.forEach(r => {
+        var last = out[out.length - 1]
+        if (last && last.addr + last.data.length >= r.addr) {
+            var end = Math.max(last.addr + last.data.length, r.addr + r.data.length)
+            var buf = Buffer.alloc(end - last.addr, 0xff)
+            last.data.copy(buf)
+            r.data.copy(buf, r.addr - last.addr)
+            last.data = buf
+        } else {
+            out.push(r)
+        }
+    })
+    this.regions = out
+}
+
+function parseHex(text) {
+    var img = new Image()
+    var upper = 0
+    var chunks = []
+    text.split(/\r?\n/).forEach(ln => {
+        if (ln[0] != ":")
+            return
+        var rec = Buffer.from(ln.slice(1), "hex")
+        var len = rec[0]
+        var addr = rec.readUInt16BE(1)
+        var type = rec[3]
+        var data = rec.slice(4, 4 + len)
+        if (type == 0)
+            chunks.push({ addr: upper + addr, data: data })
+        else if (type == 2)
+            upper = data.readUInt16BE(0) << 4
+        else if (type == 4)
+            upper = data.readUInt16BE(0) * 0x10000
+        else if (type == 3 || type == 5) {
+            img.startType = type
+            img.startValue = data.readUInt32BE(0)
+        }
+    })
+    // Consecutive records are collected in one go; the hex files from the
+    // build are nearly all consecutive, so this avoids quadratic copying.
+    chunks.sort((a, b) => a.addr - b.addr)
+    var cur = null, parts = []
+    var flush = () => {
+        if (cur !== null)
+            img.regions.push({ addr: cur, data: Buffer.concat(parts) })
+    }
+    var next = -1
+    chunks.forEach(c => {
+        if (c.addr != next) {
+            flush()
+            cur = c.addr
+            parts = []
+        }
+        parts.push(c.data)
+        next = c.addr + c.data.length
+    })
+    flush()
+    img.merge()
+    img.functionsAddr = img.findMagic()
+    return img
+}
+
+function toHex(img) {
+    var lines = []
+    var record = (type, addr, data) => {
+        var rec = Buffer.alloc(5 + data.length)
+        rec[0] = data.length
+        rec.writeUInt16BE(addr & 0xffff, 1)
+        rec[3] = type
+        data.copy(rec, 4)
+        var sum = 0
+        for (var i = 0; i < rec.length - 1; ++i)
+            sum += rec[i]
+        rec[rec.length - 1] = (-sum) & 0xff
+        lines.push(":" + rec.toString("hex").toUpperCase())
+    }
+    var upper = -1
+    img.regions.forEach(r => {
+        var off = 0
+        while (off < r.data.length) {
+            var addr = r.addr + off
+            // records don't cross 64k boundaries
+            var n = Math.min(16, r.data.length - off, 0x10000 - (addr & 0xffff))
+            if ((addr >>> 16) != upper) {
+                upper = addr >>> 16
+                var u = Buffer.alloc(2)
+                u.writeUInt16BE(upper)
+                record(4, 0, u)
+            }
+            record(0, addr, r.data.slice(off, off + n))
+            off += n
+        }
+    })
+    if (img.startType) {
+        var s = Buffer.alloc(4)
+        s.writeUInt32BE(img.startValue)
+        record(img.startType, 0, s)
+    }
+    record(1, 0, Buffer.alloc(0))
+    return lines.join("\n") + "\n"
+}
+
+function Writer() {
+    this.parts = []
+}
+Writer.prototype.u32 = function (v) {
+    var b = Buffer.alloc(4)
+    b.writeUInt32LE(v >>> 0)
+    this.parts.push(b)
+}
+Writer.prototype.bytes = function (b) {
+    this.parts.push(b)
+    if (b.length % 4)
+        this.parts.push(Buffer.alloc(4 - b.length % 4))
+}
+Writer.prototype.buffer = function () {
+    return Buffer.concat(this.parts)
+}
+
+function Reader(buf, tag) {
+    if (buf.toString("ascii", 0, 4) != tag || buf.readUInt32LE(4) != 1)
+        throw new Error("not a " + tag + " file")
+    this.buf = buf
+    this.pos = 8
+}
+Reader.prototype.u32 = function () {
+    var v = this.buf.readUInt32LE(this.pos)
+    this.pos += 4
+    return v
+}
+Reader.prototype.bytes = function (n) {
+    var b = this.buf.slice(this.pos, this.pos + n)
+    this.pos += (n + 3) & ~3
+    return b
+}
+
+function encodeImage(img) {
+    var w = new Writer()
+    w.bytes(Buffer.from("BVIM"))
+    w.u32(1)
+    w.u32(img.functionsAddr)
+    w.u32(img.startType)
+    w.u32(img.startValue)
+    w.u32(img.regions.length)
+    img.regions.forEach(r => { w.u32(r.addr); w.u32(r.data.length) })
+    img.regions.forEach(r => w.bytes(r.data))
+    return w.buffer()
+}
+
+function decodeImage(buf) {
+    var rd = new Reader(buf, "BVIM")
+    var img = new Image()
+    img.functionsAddr = rd.u32()
+    img.startType = rd.u32()
+    img.startValue = rd.u32()
+    var n = rd.u32()
+    var layout = []
+    for (var i = 0; i < n; ++i)
+        layout.push({ addr: rd.u32(), len: rd.u32() })
+    layout.forEach(l => img.regions.push({ addr: l.addr, data: Buffer.from(rd.bytes(l.len)) }))
+    return img
+}
+
+function sha256(buf) {
+    return crypto.createHash("sha256").update(buf).digest()
+}
+
+// Differing runs closer than this are sent as one patch.
+var PATCH_GAP = 16
+
+function makeDelta(baseBuf, target) {
+    var base = decodeImage(baseBuf)
+    var w = new Writer()
+    w.bytes(Buffer.from("BVDL"))
+    w.u32(1)
+    w.bytes(sha256(baseBuf))
+    w.u32(target.functionsAddr)
+    w.u32(target.startType)
+    w.u32(target.startValue)
+    w.u32(target.regions.length)
+    target.regions.forEach(r => { w.u32(r.addr); w.u32(r.data.length) })
+
+    var patches = []
+    target.regions.forEach(r => {
+        var baseData = Buffer.alloc(r.data.length, 0xff)
+        base.regions.forEach(b => {
+            var from = Math.max(b.addr, r.addr)
+            var to = Math.min(b.addr + b.data.length, r.addr + r.data.length)
+            if (from < to)
+                b.data.copy(baseData, from - r.addr, from - b.addr, to - b.addr)
+        })
+        var start = -1, lastDiff = -1
+        for (var i = 0; i <= r.data.length; ++i) {
+            var differs = i < r.data.length && r.data[i] != baseData[i]
+            if (differs) {
+                if (start < 0)
+                    start = i
+                lastDiff = i
+            } else if (start >= 0 && (i - lastDiff > PATCH_GAP || i == r.data.length)) {
+                patches.push({ addr: r.addr + start, data: r.data.slice(start, lastDiff + 1) })
+                start = -1
+            }
+        }
+    })
+    w.u32(patches.length)
+    patches.forEach(p => { w.u32(p.addr); w.u32(p.data.length); w.bytes(p.data) })
+    return w.buffer()
+}
+
+function applyDelta(baseBuf, deltaBuf) {
+    var base = decodeImage(baseBuf)
+    var rd = new Reader(deltaBuf, "BVDL")
+    if (!rd.bytes(32).equals(sha256(baseBuf)))
+        throw new Error("delta was made against a different base image")
+    var img = new Image()
+    img.functionsAddr = rd.u32()
+    img.startType = rd.u32()
+    img.startValue = rd.u32()
+    var n = rd.u32()
+    for (var i = 0; i < n; ++i) {
+        var addr = rd.u32(), len = rd.u32()
+        var data = Buffer.alloc(len, 0xff)
+        base.regions.forEach(b => {
+            var from = Math.max(b.addr, addr)
+            var to = Math.min(b.addr + b.data.length, addr + len)
+            if (from < to)
+                b.data.copy(data, from - addr, from - b.addr, to - b.addr)
+        })
+        img.regions.push({ addr: addr, data: data })
+    }
+    n = rd.u32()
+    for (var i = 0; i < n; ++i) {
+        var addr = rd.u32(), len = rd.u32()
+        var data = rd.bytes(len)
+        var r = img.regions.find(r => r.addr <= addr && addr + len <= r.addr + r.data.length)
+        data.copy(r.data, addr - r.addr)
+    }
+    return img
+}
+
+// The compiled program goes after the runtime: by default right after the
+// end of the region holding functionsAndBytecode, aligned like it is.
+function codeAddress(img) {
+    var r = img.regions.find(r => r.addr <= img.functionsAddr && img.functionsAddr < r.addr + r.data.length)
+    if (!r)
+        throw new Error("no functionsAndBytecode in image")
+    return (r.addr + r.data.length + 0x1f) & ~0x1f
+}
+
+module.exports = {
+    parseHex: parseHex,
+    toHex: toHex,
+    encodeImage: encodeImage,
+    decodeImage: decodeImage,
+    makeDelta: makeDelta,
+    applyDelta: applyDelta,
+    codeAddress: codeAddress,
+}
+
+function main(args) {
+    var usage = () => {
+        console.log("Binary flash images and deltas.")
+        console.log("USAGE: node flashimage.js pack file.hex out.bin")
+        console.log("       node flashimage.js delta base.bin file.hex out.bvd")
+        console.log("       node flashimage.js patch base.bin [-d delta.bvd] [-h header.bin] [-a addr] code.bin out.hex")
+        process.exit(1)
+    }
+    if (args[0] == "pack" && args.length == 3) {
+        var img = parseHex(fs.readFileSync(args[1], "utf8"))
+        fs.writeFileSync(args[2], encodeImage(img))
+        console.log(img.regions.length + " regions, functionsAndBytecode at 0x" + img.functionsAddr.toString(16))
+    } else if (args[0] == "delta" && args.length == 4) {
+        var delta = makeDelta(fs.readFileSync(args[1]), parseHex(fs.readFileSync(args[2], "utf8")))
+        fs.writeFileSync(args[3], delta)
+        console.log(delta.length + " bytes")
+    } else if (args[0] == "patch" && args.length >= 4) {
+        // Applies the delta, if any, then writes the program: header.bin over
+        // the magic at functionsAndBytecode, and code.bin at addr.
+        var base = fs.readFileSync(args[1])
+        var opts = {}
+        var rest = []
+        for (var i = 2; i < args.length; ++i) {
+            if (/^-[dha]$/.test(args[i]))
+                opts[args[i][1]] = args[++i]
+            else
+                rest.push(args[i])
+        }
+        if (rest.length != 2)
+            usage()
+        var img = opts.d ? applyDelta(base, fs.readFileSync(opts.d)) : decodeImage(base)
+        if (opts.h)
+            img.write(img.functionsAddr, fs.readFileSync(opts.h))
+        var addr = opts.a ? parseInt(opts.a) : codeAddress(img)
+        img.write(addr, fs.readFileSync(rest[0]))
+        fs.writeFileSync(rest[1], toHex(img))
+        console.log("code at 0x" + addr.toString(16))
+    } else {
+        usage()
+    }
+}
+
+if (require.main === module)
+    main(process.argv.slice(2))
+
+// vim: ts=4 sw=4
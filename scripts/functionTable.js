@@ -14,6 +14,62 @@ var prefixes = ["bitvm::bitvm_", "bitvm::", "touch_develop::", ""]
 var fullfuns = {}
 var basenames = {}
 var enums = {}
+var defines = {}
+var abi = {}
+
+// How TD values show up in C++ signatures. Anything not listed is only used
+// between native functions.
+var kinds = {
+    "int": "number",
+    "uint8_t": "number",
+    "uint16_t": "number",
+    "size_t": "number",
+    "char": "number",
+    "ERROR": "number",
+    "bool": "bool",
+    "uint32_t": "any", // a number, or a reference, depending on the call site
+    "StringData*": "string",
+    "ImageData*": "image",
+    "RefRecord*": "record",
+    "RefCollection*": "collection",
+    "RefBuffer*": "buffer",
+    "Action": "action",
+    "RefAction*": "action",
+    "RefEnv*": "env",
+    "RefStopwatch*": "stopwatch",
+    "RefLocal*": "local",
+    "RefRefLocal*": "local",
+    "RefObject*": "object",
+    "void": "void",
+}
+var primitive = { number: 1, bool: 1, void: 1, native: 1 }
+
+function typeInfo(tp) {
+    var kind = kinds[tp.replace(/\s+/g, "")] || "native"
+    // "RefAction *" -> "RefAction*", "MicroBitPin &" -> "MicroBitPin&"
+    var r = { type: tp.trim().replace(/\s+/g, " ").replace(/ ([*&])/g, "$1"), kind: kind }
+    if (!primitive[kind])
+        r.owned = false
+    return r
+}
+
+// Ref-counted parameters are borrowed, unless marked OWNED; ref-counted
+// results are always owned by the caller.
+function paramInfo(args) {
+    if (args.trim() == "")
+        return []
+    return args.split(/,/).map(a => {
+        a = a.replace(/=.*/, "").trim()
+        var owned = /^OWNED\s/.test(a)
+        a = a.replace(/^OWNED\s+/, "")
+        var m = /^(.*?)(\w+)$/.exec(a)
+        var r = typeInfo(m[1])
+        r = Object.assign({ name: m[2] }, r)
+        if (owned)
+            r.owned = true
+        return r
+    })
+}
 
 process.argv.slice(2).forEach(function (fn) {
     var type = null;
@@ -44,6 +100,17 @@ process.argv.slice(2).forEach(function (fn) {
             return;
         }
 
+        // Object layout constants; see BITVM_ABI_* in BitVM.h
+        m = /^\s*#define\s+(BITVM_\w+)\s+(\w+)\s*(\/\/.*)?$/.exec(ln)
+        if (m) {
+            var v = /^\d/.test(m[2]) ? parseInt(m[2]) : defines[m[2]]
+            if (v !== undefined) {
+                defines[m[1]] = v
+                if (/^BITVM_ABI_/.test(m[1]))
+                    abi[m[1].slice(10).toLowerCase().replace(/_(\w)/g, (a, b) => b.toUpperCase())] = v
+            }
+        }
+
         var top = nsStack[nsStack.length - 1]
 
         if (justPushed) {
@@ -64,6 +131,15 @@ process.argv.slice(2).forEach(function (fn) {
             }
         }
 
+        // GLUE, ATOMIC, PURE and INTERNAL markers; see BitVM.h
+        var marks = {}
+        ln = ln.replace(/^(\s*)((GLUE|ATOMIC|PURE|INTERNAL)\s+)+/, (all, indent) => {
+            all.replace(/GLUE|ATOMIC|PURE|INTERNAL/g, w => marks[w] = true)
+            return indent
+        })
+        if (marks.INTERNAL)
+            return
+
         m = /^(\s*)(\w+)([\*\&]*\s+[\*\&]*)(\w+)\s*\(([^\(\)]*)\)\s*(;\s*$|\{|$)/.exec(ln)
         if (top && m && !/^(else|return)$/.test(m[2])) {
             if (top.isClass) {
@@ -86,13 +162,22 @@ process.argv.slice(2).forEach(function (fn) {
                 args = m[5].replace(/[^,]/g, "").length + 1
 
             console.log(fn + ": found " + name);
+            var returns = typeInfo(m[2] + m[3])
+            if (returns.owned === false)
+                returns.owned = true
             var inf = fullfuns[name] = {
                 proto: "",
                 name: name,
                 type: tp,
                 args: args,
                 full: name,
+                params: paramInfo(m[5]),
+                returns: returns,
             }
+            if (marks.ATOMIC || marks.PURE)
+                inf.atomic = true
+            if (marks.PURE)
+                inf.pure = true
 
             prefixes.forEach(p => {
                 if (name.slice(0, p.length) == p &&
@@ -102,7 +187,7 @@ process.argv.slice(2).forEach(function (fn) {
             basenames[name] = 1;
             var fmt = (s,n) => s.length >= n ? s + " " : (s + "                                                    ").slice(0, n)
             var rettp = (m[2] + m[3]).replace(/\s+/, "")
-            inf.proto = fmt(rettp, 15) + fmt(name, 30) + fmt("(" + m[5] + ");", 40)
+            inf.proto = fmt(rettp, 15) + fmt(name, 30) + fmt("(" + m[5].replace(/OWNED\s+/g, "") + ");", 40)
         }
     })
 
@@ -141,6 +226,7 @@ funnames.forEach(bn => {
 })
 
 var metainfo = {
+  abi: abi,
   functions: functions,
   enums: enums
 }
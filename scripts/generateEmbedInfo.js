@@ -7,10 +7,20 @@ if (process.argv.length < 4) {
 }
 
 var fs = require('fs');
+var crypto = require('crypto');
+var flashimage = require('./flashimage');
 
-var hex = fs.readFileSync(process.argv[2], "utf8").split(/\r?\n/)
+var hexText = fs.readFileSync(process.argv[2], "utf8")
+var hex = hexText.split(/\r?\n/)
 var metainfo = JSON.parse(fs.readFileSync("generated/metainfo.json", "utf8"))
 
+// The same runtime as a binary image (see flashimage.js); editors that can
+// use it fetch build/runtime.bin, and build/bytecode-image.js which is
+// bytecode.js without the hex.
+var img = flashimage.parseHex(hexText)
+var bin = flashimage.encodeImage(img)
+fs.writeFileSync("build/runtime.bin", bin)
+
 var s = "{\n";
 s += "functions: [\n";
 metainfo.functions.forEach(f => {
@@ -20,10 +30,20 @@ s += "],\n";
 function addfld(n, v) {
   s += n + ": " + JSON.stringify(v, null, 2) + ",\n";
 };
+addfld("abi", metainfo.abi)
 addfld("enums", metainfo.enums)
+addfld("image", {
+  file: "runtime.bin",
+  sha256: crypto.createHash("sha256").update(bin).digest("hex"),
+  size: bin.length,
+  functionsAddr: img.functionsAddr,
+  codeAddr: flashimage.codeAddress(img),
+})
+var noHex = s + "}\n"
 addfld("hex", hex)
 s += "}\n"
 fs.writeFileSync("build/bytecode.js", "TDev.bytecodeInfo = " + s)
+fs.writeFileSync("build/bytecode-image.js", "TDev.bytecodeInfo = " + noHex)
 fs.writeFileSync("build/hexinfo.js", "module.exports = " + s)
 
 // vim: ts=4 sw=4
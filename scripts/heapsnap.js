@@ -0,0 +1,232 @@
+"use strict";
+
+if (process.argv.length < 3) {
+  console.log("Analyze a heap snapshot (bitvm::heapSnapshot(), needs DEBUG_MEMLEAKS).")
+  console.log("USAGE: node heapsnap.js snapshot.bin [number-of-objects-to-list]")
+  process.exit(1)
+}
+
+var fs = require('fs');
+
+var typeNames = ["object", "struct", "collection", "buffer", "record", "action", "local", "reflocal", "native", "env", "stopwatch"]
+var RAM_START = 0x20000000
+
+// REF_EXTENSION and up are types registered by extensions
+var typeName = t => typeNames[t] || (t >= 16 ? "ext" + (t - 16) : "type" + t)
+
+function hex(addr) {
+    return "0x" + (addr + RAM_START).toString(16)
+}
+
+// See heapSnapshot() in source/bitvm.cpp for the format.
+function parseSnapshot(buf) {
+    var pos = buf.indexOf("BVHS\x01")
+    if (pos < 0) {
+        console.log("no snapshot header found")
+        process.exit(1)
+    }
+    pos += 5
+
+    function varint() {
+        var v = 0, shift = 0
+        while (true) {
+            if (pos >= buf.length) {
+                console.log("truncated snapshot")
+                process.exit(1)
+            }
+            var b = buf[pos++]
+            v += (b & 0x7f) * Math.pow(2, shift)
+            shift += 7
+            if (!(b & 0x80))
+                return v
+        }
+    }
+
+    var objects = {}
+    var n = varint()
+    for (var i = 0; i < n; ++i) {
+        var o = { addr: varint(), type: buf[pos++] }
+        o.size = varint()
+        o.refcnt = varint()
+        o.refs = []
+        var k = varint()
+        for (var j = 0; j < k; ++j)
+            o.refs.push(varint())
+        objects[o.addr] = o
+    }
+
+    var roots = []
+    n = varint()
+    for (var i = 0; i < n; ++i) {
+        var kind = buf[pos++]
+        var key = varint()
+        var addr = varint()
+        roots.push({
+            name: kind == 0 ? "global[" + key + "]" : "handler(" + (key >>> 16) + "," + (key & 0xffff) + ")",
+            addr: addr,
+        })
+    }
+    return { objects: objects, roots: roots }
+}
+
+// Cooper, Harvey, Kennedy: "A Simple, Fast Dominance Algorithm".
+function dominators(nodes, entry) {
+    var order = []
+    var seen = {}
+    function dfs(n) {
+        // iterative, the graphs can be deep (linked lists)
+        var stack = [{ n: n, i: 0 }]
+        seen[n.id] = true
+        while (stack.length) {
+            var top = stack[stack.length - 1]
+            if (top.i < top.n.succ.length) {
+                var s = top.n.succ[top.i++]
+                if (!seen[s.id]) {
+                    seen[s.id] = true
+                    stack.push({ n: s, i: 0 })
+                }
+            } else {
+                top.n.po = order.length
+                order.push(top.n)
+                stack.pop()
+            }
+        }
+    }
+    dfs(entry)
+
+    entry.idom = entry
+    function intersect(a, b) {
+        while (a !== b) {
+            while (a.po < b.po) a = a.idom
+            while (b.po < a.po) b = b.idom
+        }
+        return a
+    }
+    var changed = true
+    while (changed) {
+        changed = false
+        for (var i = order.length - 2; i >= 0; --i) {
+            var n = order[i]
+            var idom = null
+            n.pred.forEach(p => {
+                if (p.idom)
+                    idom = idom ? intersect(p, idom) : p
+            })
+            if (idom !== n.idom) {
+                n.idom = idom
+                changed = true
+            }
+        }
+    }
+    return order
+}
+
+var limit = parseInt(process.argv[3] || "20")
+var snap = parseSnapshot(fs.readFileSync(process.argv[2]))
+
+var nodes = {}
+function node(addr) {
+    if (!nodes[addr]) {
+        var o = snap.objects[addr] || { addr: addr, type: 8, size: 0, refcnt: 0, refs: [], unknown: true }
+        nodes[addr] = { id: "o" + addr, obj: o, succ: [], pred: [], name: typeName(o.type) + "@" + hex(addr) }
+    }
+    return nodes[addr]
+}
+function edge(a, b) {
+    a.succ.push(b)
+    b.pred.push(a)
+}
+
+Object.keys(snap.objects).forEach(a => node(parseInt(a)))
+Object.keys(snap.objects).forEach(a => {
+    snap.objects[a].refs.forEach(r => edge(nodes[a], node(r)))
+})
+
+var top = { id: "top", succ: [], pred: [], name: "<roots>", obj: { size: 0 } }
+snap.roots.forEach(r => {
+    var rn = { id: r.name, succ: [], pred: [], name: r.name, obj: { size: 0 }, isRoot: true }
+    edge(top, rn)
+    edge(rn, node(r.addr))
+})
+
+// Objects not reachable from globals or handlers are held by fiber stacks,
+// or are cycles leaked by ref-counting. Hang them off a pseudo-root of their
+// own, preferring ones nothing else points to.
+var unrooted = { id: "unrooted", succ: [], pred: [], name: "<unrooted>", obj: { size: 0 }, isRoot: true }
+edge(top, unrooted)
+while (true) {
+    var reach = {}
+    var stack = [top]
+    reach.top = true
+    while (stack.length) {
+        stack.pop().succ.forEach(s => {
+            if (!reach[s.id]) {
+                reach[s.id] = true
+                stack.push(s)
+            }
+        })
+    }
+    var rest = Object.keys(nodes).map(a => nodes[a]).filter(n => !reach[n.id])
+    if (rest.length == 0)
+        break
+    var entry = rest.find(n => n.pred.every(p => reach[p.id])) || rest[0]
+    entry.leakSuspect = !rest.find(n => n.pred.every(p => reach[p.id]))
+    edge(unrooted, entry)
+}
+
+var order = dominators(nodes, top)
+order.forEach(n => n.retained = n.obj.size)
+order.forEach(n => { if (n !== top) n.idom.retained += n.retained })
+
+function path(n) {
+    var p = []
+    while (n !== top) {
+        p.unshift(n.name)
+        n = n.idom
+    }
+    return p.join(" -> ")
+}
+
+var byType = {}
+var total = 0
+Object.keys(nodes).forEach(a => {
+    var o = nodes[a].obj
+    var t = typeName(o.type)
+    byType[t] = byType[t] || { count: 0, bytes: 0 }
+    byType[t].count++
+    byType[t].bytes += o.size
+    total += o.size
+})
+
+var fmt = (s, n) => (s + "                    ").slice(0, n)
+console.log("objects: " + Object.keys(nodes).length + ", " + total + " bytes, roots: " + snap.roots.length)
+console.log("")
+console.log(fmt("type", 12) + fmt("count", 8) + "bytes")
+Object.keys(byType).forEach(t => console.log(fmt(t, 12) + fmt(byType[t].count, 8) + byType[t].bytes))
+console.log("")
+
+console.log("largest retained sizes:")
+order.filter(n => n.obj.addr !== undefined || n.isRoot)
+    .sort((a, b) => b.retained - a.retained)
+    .slice(0, limit)
+    .forEach(n => console.log("  " + fmt(n.retained, 8) + path(n)))
+console.log("")
+
+var leaks = order.filter(n => n.leakSuspect)
+if (leaks.length) {
+    console.log("unreachable cycles (leaked by ref-counting?):")
+    leaks.forEach(n => console.log("  " + fmt(n.retained, 8) + n.name + " r=" + n.obj.refcnt))
+    console.log("")
+}
+
+// A ref-count higher than the number of heap references means the rest is
+// held from somewhere the snapshot can't see, typically a fiber's stack.
+var heapRefs = n => n.pred.filter(p => p !== unrooted).length
+var external = Object.keys(nodes).map(a => nodes[a])
+    .filter(n => !n.obj.unknown && n.obj.refcnt > heapRefs(n))
+if (external.length) {
+    console.log("objects with references from outside the heap: " + external.length)
+    external.slice(0, limit).forEach(n => console.log("  " + n.name + " r=" + n.obj.refcnt + " heap refs=" + heapRefs(n)))
+}
+
+// vim: ts=4 sw=4
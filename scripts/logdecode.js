@@ -0,0 +1,154 @@
+"use strict";
+
+if (process.argv.length < 3) {
+  console.log("Turn a binary log (BITVM_BINARY_LOG) captured from the serial port back into text.")
+  console.log("USAGE: node logdecode.js capture.bin [source files...]")
+  process.exit(1)
+}
+
+var fs = require('fs');
+var path = require('path');
+
+var root = path.resolve(__dirname, "..")
+var sources = process.argv.length > 3 ? process.argv.slice(3) :
+    ["source", "microbit-touchdevelop"]
+        .map(d => fs.readdirSync(path.join(root, d)).filter(f => /\.(cpp|h)$/.test(f)).map(f => path.join(root, d, f)))
+        .reduce((a, b) => a.concat(b), [path.join(root, "generated", "extensions.inc")])
+
+var LOG_MARK = 0xfe
+var idMask = 0x1fffff
+
+// Same as BinLog::hash() in BitVM.h, over the bytes of the literal.
+function hash(s) {
+    var h = 0x811c9dc5
+    for (var i = 0; i < s.length; ++i)
+        h = Math.imul(h ^ s.charCodeAt(i), 16777619) >>> 0
+    return (h & idMask) >>> 0
+}
+
+function unescape(lit) {
+    return lit.replace(/\\(x[0-9a-fA-F]+|[0-7]{1,3}|.)/g, (all, e) => {
+        if (e[0] == "x")
+            return String.fromCharCode(parseInt(e.slice(1), 16) & 0xff)
+        if (/^[0-7]/.test(e))
+            return String.fromCharCode(parseInt(e, 8) & 0xff)
+        return { n: "\n", t: "\t", r: "\r", a: "\x07", b: "\b", f: "\f", v: "\v" }[e] || e
+    })
+}
+
+// The format strings of all printf() and DBG() calls, by ID. Sources are read
+// as latin1, so that each char is one byte, as the compiler sees it.
+var formats = {}
+sources.forEach(fn => {
+    if (!fs.existsSync(fn))
+        return
+    var text = fs.readFileSync(fn, "latin1")
+    var m = /#define\s+BITVM_LOG_ID_MASK\s+(0x[0-9a-fA-F]+|\d+)/.exec(text)
+    if (m)
+        idMask = parseInt(m[1])
+    var re = /\b(printf|DBG)\s*\(\s*((?:"(?:[^"\\\n]|\\.)*"\s*)+)/g
+    while ((m = re.exec(text))) {
+        var fmt = m[2].match(/"(?:[^"\\\n]|\\.)*"/g).map(l => unescape(l.slice(1, -1))).join("")
+        var lineNo = text.slice(0, m.index).split("\n").length
+        formats[fmt] = formats[fmt] || path.relative(root, fn) + ":" + lineNo
+    }
+})
+
+var byId = {}
+Object.keys(formats).forEach(fmt => {
+    var id = hash(fmt)
+    if (byId[id] !== undefined && byId[id] != fmt)
+        console.error("warning: " + formats[fmt] + " and " + formats[byId[id]] + " have the same ID; change one of the strings")
+    byId[id] = fmt
+})
+
+var buf = fs.readFileSync(process.argv[2])
+var pos = 0
+
+function varint() {
+    var v = 0, shift = 0
+    while (pos < buf.length) {
+        var b = buf[pos++]
+        v += (b & 0x7f) * Math.pow(2, shift)
+        shift += 7
+        if (!(b & 0x80))
+            return v >>> 0
+    }
+    throw new Error("truncated")
+}
+
+function cstring() {
+    var end = buf.indexOf(0, pos)
+    if (end < 0)
+        throw new Error("truncated")
+    var s = buf.slice(pos, end).toString("latin1")
+    pos = end + 1
+    return s
+}
+
+function pad(s, flags, width) {
+    width = parseInt(width || "0")
+    if (s.length >= width)
+        return s
+    if (flags.indexOf("-") >= 0)
+        return s + " ".repeat(width - s.length)
+    if (flags.indexOf("0") >= 0 && /^-?[0-9a-fA-Fx]+$/.test(s)) {
+        var sign = s[0] == "-" ? "-" : ""
+        return sign + "0".repeat(width - s.length) + s.slice(sign.length)
+    }
+    return " ".repeat(width - s.length) + s
+}
+
+// printf(), with the arguments read from the log as the format asks for them.
+function format(fmt) {
+    return fmt.replace(/%([-+ 0#]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|z|t|j)?([diouxXcsp%])/g, (all, flags, width, prec, len, conv) => {
+        if (conv == "%")
+            return "%"
+        if (conv == "s") {
+            var s = cstring()
+            return pad(prec ? s.slice(0, parseInt(prec)) : s, flags, width)
+        }
+        var v = varint()
+        var r
+        switch (conv) {
+            case "d": case "i": r = "" + (v | 0); break
+            case "u": r = "" + v; break
+            case "x": r = v.toString(16); break
+            case "X": r = v.toString(16).toUpperCase(); break
+            case "o": r = v.toString(8); break
+            case "c": r = String.fromCharCode(v & 0xff); break
+            case "p": r = "0x" + v.toString(16); break
+        }
+        if (flags.indexOf("#") >= 0 && /[xX]/.test(conv) && v)
+            r = "0" + conv + r
+        if (flags.indexOf("+") >= 0 && /[di]/.test(conv) && (v | 0) >= 0)
+            r = "+" + r
+        return pad(r, flags, width)
+    })
+}
+
+var out = ""
+try {
+    while (pos < buf.length) {
+        var b = buf[pos++]
+        if (b != LOG_MARK) {
+            out += String.fromCharCode(b)
+            continue
+        }
+        var id = varint()
+        var fmt = byId[id]
+        if (fmt === undefined) {
+            // can't tell how many arguments follow; skip to the next mark
+            out += "[unknown log ID " + id + "]\n"
+            while (pos < buf.length && buf[pos] != LOG_MARK)
+                pos++
+            continue
+        }
+        out += format(fmt)
+    }
+} catch (e) {
+    out += "[" + e.message + "]\n"
+}
+process.stdout.write(Buffer.from(out, "latin1"))
+
+// vim: ts=4 sw=4
@@ -0,0 +1,208 @@
+"use strict";
+
+if (process.argv.length < 3) {
+  console.log("Report flash and RAM use per module and shim namespace, and what changed since the last build.")
+  console.log("USAGE: node memreport.js file.elf [file.map]")
+  process.exit(1)
+}
+
+var fs = require('fs');
+var path = require('path');
+var child_process = require('child_process');
+
+var elf = process.argv[2]
+var mapFile = process.argv[3] || elf.replace(/(\.elf)?$/, ".map")
+var nm = process.env.NM || "arm-none-eabi-nm"
+var reportFile = path.join(path.dirname(elf), "memreport.json")
+var RAM_START = 0x20000000
+
+// Which of text (flash only), data (flash and RAM) and bss (RAM only) an
+// output section counts towards; null for the ones that aren't loaded.
+function category(section, addr) {
+    if (/^\.(debug|comment|ARM\.attributes|stab|gnu\.attributes)/.test(section))
+        return null
+    if (/bss|heap|stack|noinit/.test(section))
+        return "bss"
+    if (/^\.data/.test(section))
+        return "data"
+    return addr >= RAM_START ? "bss" : "text"
+}
+
+// "dir/libmicrobit-dal.a(MicroBitDisplay.cpp.o)" -> "microbit-dal:MicroBitDisplay.cpp",
+// "dir/source/bitvm.cpp.o" -> "bitvm.cpp"
+function moduleName(file) {
+    var m = /([^\/\\]+)\.a\((.*)\)$/.exec(file)
+    if (m)
+        return m[1].replace(/^lib/, "") + ":" + m[2].replace(/\.o(bj)?$/, "")
+    return path.basename(file).replace(/\.o(bj)?$/, "")
+}
+
+// Sizes of the input sections in the GNU ld map, per module. The output
+// sections go into [sections], for placing weak symbols.
+function parseMap(text, sections) {
+    var modules = {}
+    var lines = text.split(/\r?\n/)
+    var start = lines.findIndex(l => /^Linker script and memory map/.test(l))
+    var out = null, outAddr = 0
+    var pending = null
+    for (var i = start + 1; i < lines.length; ++i) {
+        var ln = lines[i]
+        var m = /^(\.\S+)(\s+0x([0-9a-f]+)\s+0x([0-9a-f]+))?/.exec(ln)
+        if (m) {
+            out = m[1]
+            outAddr = m[3] ? parseInt(m[3], 16) : 0
+            if (m[3])
+                sections.push({ name: out, addr: outAddr, size: parseInt(m[4], 16) })
+            continue
+        }
+        // " .text.foo  0xaddr  0xsize  file", possibly split after the name
+        m = /^ (\S+)\s*$/.exec(ln)
+        if (m) {
+            pending = m[1]
+            continue
+        }
+        m = /^ (\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s*(.*)$/.exec(ln)
+        if (m && (m[1] || pending) && out) {
+            var name = m[1] || pending
+            var addr = parseInt(m[2], 16)
+            var size = parseInt(m[3], 16)
+            var cat = category(out, outAddr || addr)
+            if (cat && size > 0) {
+                var mod = name == "*fill*" ? "(fill)" : m[4] ? moduleName(m[4].trim()) : "(linker)"
+                modules[mod] = modules[mod] || { text: 0, data: 0, bss: 0 }
+                modules[mod][cat] += size
+            }
+        }
+        pending = null
+    }
+    return modules
+}
+
+function namespaceOf(sym) {
+    var s = sym.replace(/\(.*/, "")
+    while (/<[^<>]*>/.test(s))
+        s = s.replace(/<[^<>]*>/g, "")
+    var parts = s.split("::")
+    return parts.length > 1 ? parts.slice(0, -1).join("::") : "(global)"
+}
+
+// Weak (w/W, v/V) and unique (u) symbols don't say where they are; the
+// output section their address falls in does. Without a map, RAM addresses
+// count as bss.
+function weakCategory(addr, sections) {
+    var sec = sections.find(s => s.addr <= addr && addr < s.addr + s.size)
+    return sec ? category(sec.name, addr) : addr >= RAM_START ? "bss" : "text"
+}
+
+// Symbol sizes from nm, demangled.
+function readSymbols(sections) {
+    var out
+    try {
+        out = child_process.execFileSync(nm, ["-S", "-C", "--size-sort", elf], { encoding: "utf8", maxBuffer: 64 * 1024 * 1024 })
+    } catch (e) {
+        console.log("can't run " + nm + "; no per-symbol sizes (set NM)")
+        return {}
+    }
+    var cats = { t: "text", r: "text", d: "data", b: "bss" }
+    var syms = {}
+    out.split(/\n/).forEach(ln => {
+        var m = /^([0-9a-f]+) ([0-9a-f]+) (\w) (.*)$/.exec(ln)
+        if (!m)
+            return
+        var t = m[3].toLowerCase()
+        var cat = cats[t] || (/^[wvu]$/.test(t) ? weakCategory(parseInt(m[1], 16), sections) : null)
+        if (cat)
+            syms[m[4]] = { cat: cat, size: parseInt(m[2], 16) }
+    })
+    return syms
+}
+
+function sum(rows) {
+    var t = { text: 0, data: 0, bss: 0 }
+    Object.keys(rows).forEach(k => ["text", "data", "bss"].forEach(c => t[c] += rows[k][c]))
+    return t
+}
+
+var fmt = (s, n) => (s + "                                        ").slice(0, Math.max(n, ("" + s).length + 1))
+var rfmt = (s, n) => ("                    " + s).slice(-n)
+var delta = (a, b) => a == b ? "" : (a > b ? "+" : "") + (a - b)
+
+function printTable(title, rows, prev, limit) {
+    console.log(fmt(title, 40) + rfmt("text", 8) + rfmt("data", 8) + rfmt("bss", 8) + rfmt("change", 10))
+    Object.keys(rows)
+        .sort((a, b) => (rows[b].text + rows[b].data + rows[b].bss) - (rows[a].text + rows[a].data + rows[a].bss))
+        .slice(0, limit)
+        .forEach(k => {
+            var r = rows[k], p = prev && prev[k]
+            var ch = !prev ? "" : !p ? "new" :
+                delta(r.text + r.data + r.bss, p.text + p.data + p.bss)
+            console.log(fmt(k, 40) + rfmt(r.text, 8) + rfmt(r.data, 8) + rfmt(r.bss, 8) + rfmt(ch, 10))
+        })
+    console.log("")
+}
+
+if (!fs.existsSync(elf)) {
+    console.log("no " + elf)
+    process.exit(1)
+}
+
+var report = { modules: {}, namespaces: {}, symbols: {} }
+var sections = []
+if (fs.existsSync(mapFile))
+    report.modules = parseMap(fs.readFileSync(mapFile, "utf8"), sections)
+else
+    console.log("no " + mapFile + "; no per-module sizes")
+report.symbols = readSymbols(sections)
+
+Object.keys(report.symbols).forEach(s => {
+    var ns = namespaceOf(s)
+    var sym = report.symbols[s]
+    report.namespaces[ns] = report.namespaces[ns] || { text: 0, data: 0, bss: 0 }
+    report.namespaces[ns][sym.cat] += sym.size
+})
+
+var prev = null
+if (fs.existsSync(reportFile)) {
+    prev = JSON.parse(fs.readFileSync(reportFile, "utf8"))
+    fs.renameSync(reportFile, reportFile.replace(/\.json$/, ".prev.json"))
+}
+fs.writeFileSync(reportFile, JSON.stringify(report, null, 1))
+
+var limit = parseInt(process.env.MEMREPORT_LINES || "25")
+if (Object.keys(report.modules).length)
+    printTable("module", report.modules, prev && prev.modules, limit)
+printTable("namespace", report.namespaces, prev && prev.namespaces, limit)
+
+if (prev) {
+    var changed = []
+    Object.keys(report.symbols).forEach(s => {
+        var old = prev.symbols[s] ? prev.symbols[s].size : 0
+        if (old != report.symbols[s].size)
+            changed.push({ name: s, cat: report.symbols[s].cat, size: report.symbols[s].size, old: old })
+    })
+    Object.keys(prev.symbols).forEach(s => {
+        if (!report.symbols[s])
+            changed.push({ name: s, cat: prev.symbols[s].cat, size: 0, old: prev.symbols[s].size })
+    })
+    if (changed.length) {
+        console.log("symbols changed since the previous build:")
+        changed.sort((a, b) => Math.abs(b.size - b.old) - Math.abs(a.size - a.old))
+            .slice(0, limit)
+            .forEach(c => console.log("  " + rfmt(delta(c.size, c.old), 7) + " " + fmt(c.cat, 5) + c.name))
+        console.log("")
+    }
+}
+
+// Modules cover everything that's linked; symbols miss padding and the like.
+var total = sum(Object.keys(report.modules).length ? report.modules : report.namespaces)
+var flash = total.text + total.data, ram = total.data + total.bss
+var line = "flash " + flash + " bytes, RAM " + ram + " bytes (static)"
+if (prev) {
+    var ptotal = sum(Object.keys(prev.modules).length ? prev.modules : prev.namespaces)
+    line += "; was " + (ptotal.text + ptotal.data) + " and " + (ptotal.data + ptotal.bss)
+    if (ram > ptotal.data + ptotal.bss)
+        line += " - RAM grew by " + (ram - ptotal.data - ptotal.bss) + " bytes"
+}
+console.log(line)
+
+// vim: ts=4 sw=4
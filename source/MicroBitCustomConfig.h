@@ -18,6 +18,11 @@
 #undef MESSAGE_BUS_LISTENER_DEFAULT_FLAGS
 #define MESSAGE_BUS_LISTENER_DEFAULT_FLAGS          MESSAGE_BUS_LISTENER_QUEUE_IF_BUSY
 
+// The runtime adds three idle components (deferred freeing, the ISR event
+// queue and the handler watchdog) to the DAL's own.
+#undef MICROBIT_IDLE_COMPONENTS
+#define MICROBIT_IDLE_COMPONENTS                    9
+
 #include "generated/extconfig.h"
 
 #endif
@@ -237,7 +237,7 @@ namespace touch_develop {
             if (radioDefaultGroup != MICROBIT_RADIO_DEFAULT_GROUP) {
                 uBit.radio.setGroup(radioDefaultGroup);
             }
-            memset(datagramBuf, 4, 0);           
+            memset(datagramBuf, 0, sizeof(datagramBuf));           
             radioEnabled = true;
         }
         return r;
@@ -272,13 +272,13 @@ namespace touch_develop {
         datagramBuf[2] = value2;
         datagramBuf[3] = value3;
         uBit.radio.datagram.send((uint8_t*)datagramBuf, 16);
-        memset(datagramBuf, 4, 0);      
+        memset(datagramBuf, 0, sizeof(datagramBuf));      
     }
     
     int datagramReceiveNumber() {
         if (radioEnable() != MICROBIT_OK) return 0;
         
-        memset(datagramBuf, 4, 0);
+        memset(datagramBuf, 0, sizeof(datagramBuf));
 
         PacketBuffer packet = uBit.radio.datagram.recv();
         uint8_t* buf = (uint8_t*)datagramBuf;
@@ -490,6 +490,12 @@ namespace touch_develop {
       return uBit.systemTime();
     }
 
+    // Wraps around every 71 minutes; use differences only. On the device it
+    // advances in steps of about 30.5us (RTC1, at 32768Hz).
+    int getCurrentTimeUs() {
+      return us_ticker_read();
+    }
+
     // These functions are exposed via the "micro:bit extras" library. They are
     // simplified; for any serious hardware, write the i2c communication thing
     // in C++.
@@ -1,10 +1,22 @@
 #include "BitVM.h"
 #include "MicroBitTouchDevelop.h"
 #include <cstdlib>
+#include <cstddef>
 #include <climits>
 #include <cmath>
 #include <vector>
-
+#include "nrf_sdm.h"
+#include "nrf_soc.h"
+
+#if MICROBIT_HEAP_ALLOCATOR
+// From MicroBitHeapAllocator.cpp; unlike microbit_malloc(size), the per-heap
+// allocator doesn't panic when it's full.
+extern HeapDefinition heap[MICROBIT_HEAP_COUNT];
+extern uint8_t heap_count;
+extern void *microbit_malloc(size_t size, HeapDefinition &heap);
+#else
+#include <malloc.h>
+#endif
 
 #define DBG printf
 //#define DBG(...)
@@ -20,6 +32,752 @@
 namespace bitvm {
   uint16_t *bytecode;
 
+  // The header layout published in metainfo.json has to match the code.
+  static_assert(sizeof(RefObject::refcnt) == BITVM_ABI_REFCNT_WIDTH, "refcnt width");
+  static_assert(offsetof(RefCounted, refCount) == BITVM_ABI_NATIVE_REFCNT_OFFSET, "refCount offset");
+  static_assert(sizeof(RefCounted::refCount) == BITVM_ABI_NATIVE_REFCNT_WIDTH, "refCount width");
+#ifdef __arm__
+  // RefObject isn't standard-layout (it has a vtable), but GCC lays it out
+  // the obvious way.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+  static_assert(offsetof(RefObject, refcnt) == BITVM_ABI_REFCNT_OFFSET, "refcnt offset");
+#pragma GCC diagnostic pop
+#endif
+
+  // ---------------------------------------------------------------------------
+  // Deferred freeing
+  // ---------------------------------------------------------------------------
+
+  // Dead objects wait here until gcSlice() gets to them. Each slot holds a
+  // whole object, not its children, so a collection of 1000 strings takes one
+  // slot and is released [budget] elements at a time.
+#ifndef BITVM_FREE_QUEUE_SIZE
+#define BITVM_FREE_QUEUE_SIZE 32
+#endif
+
+  // Number of references dropped inline by the unref() that killed an object,
+  // and by each allocation or idle tick afterwards.
+#ifndef BITVM_FREE_SLICE
+#define BITVM_FREE_SLICE 16
+#endif
+
+  static RefObject *freeQueue[BITVM_FREE_QUEUE_SIZE];
+  static uint16_t freeQueueHead, freeQueueLen;
+  static bool freeQueueDraining;
+  FreeQueueStats freeQueueStats;
+
+  // Objects that die while the queue is full wait on a list linked through
+  // their refcnt, which is of no use once they're dead: it holds the next
+  // one's offset from BITVM_RAM_START in words, plus one, and 0 ends the
+  // list. They move to the queue as it drains.
+  static uint16_t freeOverflow;
+
+  static inline void enqueueDead(RefObject *o)
+  {
+    freeQueue[(freeQueueHead + freeQueueLen) % BITVM_FREE_QUEUE_SIZE] = o;
+    freeQueueLen++;
+  }
+
+  static inline RefObject *overflowAt(uint16_t link)
+  {
+    return (RefObject*)(BITVM_RAM_START + (link - 1) * 4);
+  }
+
+  static RefObject *popOverflow()
+  {
+    RefObject *o = overflowAt(freeOverflow);
+    freeOverflow = o->refcnt;
+    o->refcnt = 0;
+    return o;
+  }
+
+  static void gcSlice(int budget)
+  {
+    // Objects dying while we drain just get queued behind the current one.
+    if (freeQueueLen == 0 || freeQueueDraining)
+      return;
+    freeQueueDraining = true;
+
+    uint32_t start = us_ticker_read();
+    while (freeQueueLen > 0 && budget > 0) {
+      RefObject *o = freeQueue[freeQueueHead];
+      int n = o->releaseRefs(budget);
+      if (n == 0) {
+        freeQueueHead = (freeQueueHead + 1) % BITVM_FREE_QUEUE_SIZE;
+        freeQueueLen--;
+        delete o;
+        budget--;
+        if (freeOverflow)
+          enqueueDead(popOverflow());
+      } else {
+        budget -= n;
+      }
+    }
+    uint32_t pause = us_ticker_read() - start;
+    if (pause > freeQueueStats.maxPauseUs)
+      freeQueueStats.maxPauseUs = pause;
+
+    freeQueueDraining = false;
+  }
+
+  INTERNAL void freeLater(OWNED RefObject *o)
+  {
+    if (freeQueueLen == BITVM_FREE_QUEUE_SIZE) {
+      // Very wide graphs only. Deleting it here would tear down whatever it
+      // holds recursively, with no bound on the pause or the stack. A dead
+      // closure has to leave the closure cache first, as action::mk() goes
+      // by refcnt.
+      freeQueueStats.overflows++;
+      RefAction **slot = closureCache;
+      for (int i = 0; i < BITVM_CLOSURE_CACHE; ++i, ++slot)
+        if (*slot == (RefAction*)o)
+          *slot = NULL;
+      o->refcnt = freeOverflow;
+      freeOverflow = ((uint32_t)o - BITVM_RAM_START) / 4 + 1;
+    } else {
+      enqueueDead(o);
+      if (freeQueueLen > freeQueueStats.maxQueued)
+        freeQueueStats.maxQueued = freeQueueLen;
+    }
+
+    gcSlice(BITVM_FREE_SLICE);
+  }
+
+  class FreeQueueIdle : public MicroBitComponent
+  {
+  public:
+    virtual void idleTick()
+    {
+      gcSlice(BITVM_FREE_SLICE);
+    }
+
+    virtual int isIdleCallbackNeeded()
+    {
+      return freeQueueLen > 0;
+    }
+  };
+
+  static FreeQueueIdle freeQueueIdle;
+
+  // ---------------------------------------------------------------------------
+  // Low memory
+  // ---------------------------------------------------------------------------
+
+  // Every so many allocations the runtime looks at the largest free block on
+  // the heap. Below BITVM_LOW_MEMORY bytes, the runtime drops what it can (see
+  // registerShrinker()) and raises a low-memory event, which TD code can
+  // handle with micro_bit::onLowMemory. The same happens when one of the
+  // runtime's own allocations fails, before giving up.
+  //
+  // The rest of the firmware keeps the DAL's behaviour
+  // (MICROBIT_PANIC_HEAP_FULL): microbit_malloc() panics when every heap is
+  // full, so the runtime's allocations go through tryMalloc(), which asks the
+  // DAL's heaps one by one and returns NULL instead.
+#ifndef BITVM_LOW_MEMORY
+#define BITVM_LOW_MEMORY 1024
+#endif
+#define BITVM_HEAP_CHECK_INTERVAL 64
+#define BITVM_HEAP_HISTORY 16
+#define BITVM_MAX_SHRINKERS 4
+
+  static void (*shrinkers[BITVM_MAX_SHRINKERS])();
+  static uint16_t heapHistory[BITVM_HEAP_HISTORY];
+  static uint8_t heapHistoryPos, heapHistoryLen;
+  static uint32_t heapHistoryTime;
+  static uint16_t heapLowest = 0xffff;
+  static uint16_t allocsSinceCheck;
+  static bool lowMemoryRaised;
+
+#if MICROBIT_HEAP_ALLOCATOR
+  // Unlike microbit_malloc(), this doesn't fall back to the native heap,
+  // which the DAL only leaves a few hundred bytes of.
+  static void *tryMalloc(size_t sz)
+  {
+    for (int i = 0; i < heap_count; ++i) {
+      void *p = microbit_malloc(sz, ::heap[i]);
+      if (p)
+        return p;
+    }
+    return NULL;
+  }
+
+  // Each block starts with its size in words, header included, and
+  // MICROBIT_HEAP_BLOCK_FREE when free. Adjacent free blocks are only merged
+  // by the next allocation that needs them, so they're counted as one here.
+  static int heapLargestFree()
+  {
+    uint32_t largest = 0;
+    for (int i = 0; i < heap_count; ++i) {
+      uint32_t run = 0;
+      for (uint32_t *b = ::heap[i].heap_start; b < ::heap[i].heap_end;) {
+        uint32_t words = *b & ~MICROBIT_HEAP_BLOCK_FREE;
+        if (words == 0)
+          break;
+        if (*b & MICROBIT_HEAP_BLOCK_FREE) {
+          run += words;
+          if (run > largest)
+            largest = run;
+        } else {
+          run = 0;
+        }
+        b += words;
+      }
+    }
+    return largest ? (largest - 1) * 4 : 0;
+  }
+#else
+  static inline void *tryMalloc(size_t sz)
+  {
+    return malloc(sz);
+  }
+
+  // Without the DAL's allocator there's only the total free space to go by.
+  static int heapLargestFree()
+  {
+    int n = mallinfo().fordblks;
+    return n > 0xffff ? 0xffff : n;
+  }
+#endif
+
+  void registerShrinker(void (*fn)())
+  {
+    for (int i = 0; i < BITVM_MAX_SHRINKERS; ++i)
+      if (shrinkers[i] == NULL || shrinkers[i] == fn) {
+        shrinkers[i] = fn;
+        return;
+      }
+  }
+
+  static void lowMemory()
+  {
+    while (freeQueueLen > 0)
+      gcSlice(INT_MAX);
+    for (int i = 0; i < BITVM_MAX_SHRINKERS; ++i)
+      if (shrinkers[i])
+        shrinkers[i]();
+
+    if (!lowMemoryRaised) {
+      lowMemoryRaised = true;
+      MicroBitEvent evt(BITVM_ID_RUNTIME, BITVM_EVT_LOW_MEMORY);
+    }
+  }
+
+  static void memoryCheck()
+  {
+    int avail = heapLargestFree();
+    if (avail < heapLowest)
+      heapLowest = avail;
+
+    uint32_t now = uBit.systemTime();
+    if (heapHistoryLen == 0 || now - heapHistoryTime >= 1000) {
+      heapHistoryTime = now;
+      heapHistoryPos = (heapHistoryPos + 1) % BITVM_HEAP_HISTORY;
+      heapHistory[heapHistoryPos] = avail;
+      if (heapHistoryLen < BITVM_HEAP_HISTORY)
+        heapHistoryLen++;
+    }
+
+    if (avail < BITVM_LOW_MEMORY)
+      lowMemory();
+    else if (avail >= BITVM_LOW_MEMORY * 2)
+      // re-arm the event once there's room again
+      lowMemoryRaised = false;
+  }
+
+  // All heap allocations of the runtime come through here.
+  static void *heapAlloc(size_t sz)
+  {
+    void *p = tryMalloc(sz);
+    if (p == NULL) {
+      lowMemory();
+      p = tryMalloc(sz);
+      check(p != NULL, ERR_OUT_OF_MEMORY, sz);
+    }
+    return p;
+  }
+
+  // Allocation sites pay a slice of any outstanding freeing work up front;
+  // the remainder is done from the idle fiber.
+  static inline void gcPoll()
+  {
+    if (freeQueueLen)
+      gcSlice(BITVM_FREE_SLICE);
+    if (++allocsSinceCheck == BITVM_HEAP_CHECK_INTERVAL) {
+      allocsSinceCheck = 0;
+      memoryCheck();
+    }
+  }
+
+  // All figures are the largest block that could be allocated, which is less
+  // than the total free heap when it's fragmented.
+  namespace memory {
+    int largestFree()
+    {
+      return heapLargestFree();
+    }
+
+    // Lowest seen by the periodic checks.
+    int lowest()
+    {
+      return heapLowest == 0xffff ? heapLargestFree() : heapLowest;
+    }
+
+    // Sampled about once a second, while allocations happen; history(0) is
+    // the latest sample. Returns -1 past the oldest one.
+    int history(int idx)
+    {
+      if (idx < 0 || idx >= heapHistoryLen)
+        return -1;
+      return heapHistory[(heapHistoryPos + BITVM_HEAP_HISTORY - idx) % BITVM_HEAP_HISTORY];
+    }
+  }
+
+  // ---------------------------------------------------------------------------
+  // Allocation trace
+  // ---------------------------------------------------------------------------
+
+  // With BITVM_ALLOC_TRACE defined, every allocation shim and every RefObject
+  // free is logged to the serial port in a compact binary form, to be replayed
+  // by scripts/allocsim.js. Each event is
+  //
+  //   0xF0 | kind, varint(us since previous event), varint(addr - RAM start)
+  //
+  // followed by varint(size) for allocations. The stream starts with "BVAT\x01".
+  // Strings are freed by the DAL itself, so their frees are not in the trace.
+  // RefObjects come from allocRef() (the pool, unless too big or it's full);
+  // strings and the element storage of collections and buffers (ALLOC_PAYLOAD,
+  // reallocated as they grow) come from the heap.
+  // Don't printf() while tracing.
+  enum AllocKind {
+    ALLOC_FREE = 0,
+    ALLOC_RECORD = 1,
+    ALLOC_ACTION = 2,
+    ALLOC_COLLECTION = 3,
+    ALLOC_STRING = 4,
+    ALLOC_BUFFER = 5,
+    ALLOC_LOCAL = 6,
+    ALLOC_STOPWATCH = 7,
+    ALLOC_PAYLOAD = 8,
+    ALLOC_ENV = 9,
+  };
+
+  // Binary dumps (traces, heap snapshots) go to serial as LEB128 varints.
+  static inline void sendVarint(uint32_t v)
+  {
+    while (v >= 0x80) {
+      uBit.serial.putc((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+    uBit.serial.putc(v);
+  }
+
+  static inline void sendBytes(const char *p)
+  {
+    while (*p)
+      uBit.serial.putc(*p++);
+  }
+
+#ifdef BITVM_ALLOC_TRACE
+  static uint32_t traceLastTime;
+
+  static void traceEvent(int kind, void *p, uint32_t size)
+  {
+    if (traceLastTime == 0) {
+      sendBytes("BVAT\x01");
+      traceLastTime = us_ticker_read();
+    }
+
+    uint32_t now = us_ticker_read();
+    uBit.serial.putc(0xf0 | kind);
+    sendVarint(now - traceLastTime);
+    sendVarint((uint32_t)p - BITVM_RAM_START);
+    if (kind != ALLOC_FREE)
+      sendVarint(size);
+    traceLastTime = now;
+  }
+
+#define TRACE_ALLOC(kind, p, size) traceEvent(kind, p, size)
+#define TRACE_FREE(p) traceEvent(ALLOC_FREE, p, 0)
+
+  void PayloadTrace::alloc(void *p, uint32_t size)
+  {
+    traceEvent(ALLOC_PAYLOAD, p, size);
+  }
+
+  void PayloadTrace::free(void *p)
+  {
+    traceEvent(ALLOC_FREE, p, 0);
+  }
+#else
+#define TRACE_ALLOC(kind, p, size)
+#define TRACE_FREE(p)
+#endif
+
+  // ---------------------------------------------------------------------------
+  // Binary log
+  // ---------------------------------------------------------------------------
+
+  // With BITVM_BINARY_LOG defined, each printf() sends BITVM_LOG_MARK and
+  // varint(format string ID), then the arguments: strings NUL-terminated,
+  // everything else as a varint of its 32 bits. There is no formatting on the
+  // device, and far fewer bytes to push through the serial port.
+  // scripts/logdecode.js finds the format strings in the sources by their ID
+  // and formats the text on the host. Plain text (from uBit.serial.printf()
+  // called directly) can be mixed in, as it never has the top bit set; other
+  // binary dumps can't.
+#ifdef BITVM_BINARY_LOG
+  void BinLog::begin(uint32_t id)
+  {
+    uBit.serial.putc(BITVM_LOG_MARK);
+    sendVarint(id);
+  }
+
+  void BinLog::arg(uint32_t v)
+  {
+    sendVarint(v);
+  }
+
+  void BinLog::arg(const char *s)
+  {
+    if (s)
+      sendBytes(s);
+    uBit.serial.putc(0);
+  }
+#endif
+
+  // ---------------------------------------------------------------------------
+  // Object pool
+  // ---------------------------------------------------------------------------
+
+  // RefObjects live in a region of their own, split into pages which are each
+  // dedicated to one size class. Pages of different classes never share
+  // memory, and a page goes back to the common pool as soon as it is empty,
+  // so long-running programs don't carve up the general heap with small
+  // objects. Anything bigger than the largest class, or arriving when the
+  // region is full, goes to the heap.
+#ifndef BITVM_POOL_SIZE
+#define BITVM_POOL_SIZE 3072
+#endif
+#define BITVM_POOL_PAGE 128
+#define BITVM_POOL_PAGES (BITVM_POOL_SIZE / BITVM_POOL_PAGE)
+#define BITVM_NO_SLOT 0xff
+
+  // Tuned to the actual objects: 8 is a bare RefObject, RefLocal is 12,
+  // RefCollection and RefBuffer are 20; records take 8 + 4 * fields, and
+  // actions 12 + 4 * captured locals.
+  static const uint8_t poolClassSize[BITVM_POOL_CLASSES] = {
+    8, 12, 16, 20, 24, 28, 32, 40, 48, 64
+  };
+
+  struct PoolPage {
+    uint8_t cls;      // BITVM_NO_SLOT when the page is free
+    uint8_t used;
+    uint8_t freeSlot; // head of the free list; free slots link through their first byte
+  };
+
+  static uint8_t *poolBase;
+  static bool poolUnavailable; // the region couldn't be allocated
+  static PoolPage poolPages[BITVM_POOL_PAGES];
+  // Per class, a page that had a free slot when last seen; checked before use.
+  static uint8_t poolHint[BITVM_POOL_CLASSES];
+  PoolStats poolStats;
+
+  static inline bool inPool(void *p)
+  {
+    return poolBase <= (uint8_t*)p && (uint8_t*)p < poolBase + BITVM_POOL_SIZE;
+  }
+
+  // Under memory pressure the region goes back to the heap if it's empty; the
+  // next allocation takes it again.
+  static void poolShrink()
+  {
+    if (poolBase == NULL)
+      return;
+    for (int i = 0; i < BITVM_POOL_PAGES; ++i)
+      if (poolPages[i].cls != BITVM_NO_SLOT)
+        return;
+    free(poolBase);
+    poolBase = NULL;
+  }
+
+  // Without the region everything goes to the heap. A failed attempt isn't
+  // repeated: the heap only gets more fragmented from there on.
+  static void poolInit()
+  {
+    poolBase = (uint8_t*)tryMalloc(BITVM_POOL_SIZE);
+    if (poolBase == NULL) {
+      poolUnavailable = true;
+      return;
+    }
+    for (int i = 0; i < BITVM_POOL_PAGES; ++i)
+      poolPages[i].cls = BITVM_NO_SLOT;
+    memset(poolHint, BITVM_NO_SLOT, sizeof(poolHint));
+    registerShrinker(poolShrink);
+  }
+
+  static void *poolAlloc(size_t sz)
+  {
+    int cls = 0;
+    while (cls < BITVM_POOL_CLASSES && poolClassSize[cls] < sz)
+      cls++;
+    if (cls == BITVM_POOL_CLASSES)
+      return NULL;
+
+    if (poolBase == NULL) {
+      if (poolUnavailable)
+        return NULL;
+      poolInit();
+      if (poolBase == NULL)
+        return NULL;
+    }
+
+    int idx = poolHint[cls];
+    if (idx == BITVM_NO_SLOT || poolPages[idx].cls != cls || poolPages[idx].freeSlot == BITVM_NO_SLOT) {
+      int freePage = -1;
+      idx = -1;
+      for (int i = 0; i < BITVM_POOL_PAGES; ++i) {
+        PoolPage *pg = &poolPages[i];
+        if (pg->cls == cls && pg->freeSlot != BITVM_NO_SLOT) {
+          idx = i;
+          break;
+        }
+        if (freePage < 0 && pg->cls == BITVM_NO_SLOT)
+          freePage = i;
+      }
+
+      if (idx < 0) {
+        if (freePage < 0)
+          return NULL;
+        idx = freePage;
+        PoolPage *pg = &poolPages[idx];
+        uint8_t *page = poolBase + idx * BITVM_POOL_PAGE;
+        int numSlots = BITVM_POOL_PAGE / poolClassSize[cls];
+        for (int j = 0; j < numSlots; ++j)
+          page[j * poolClassSize[cls]] = j + 1 < numSlots ? j + 1 : BITVM_NO_SLOT;
+        pg->cls = cls;
+        pg->used = 0;
+        pg->freeSlot = 0;
+        poolStats.capacity[cls] += numSlots;
+      }
+      poolHint[cls] = idx;
+    }
+
+    PoolPage *pg = &poolPages[idx];
+    uint8_t *r = poolBase + idx * BITVM_POOL_PAGE + pg->freeSlot * poolClassSize[cls];
+    pg->freeSlot = *r;
+    pg->used++;
+    poolStats.used[cls]++;
+    return r;
+  }
+
+  static void poolFree(void *p)
+  {
+    int off = (uint8_t*)p - poolBase;
+    PoolPage *pg = &poolPages[off / BITVM_POOL_PAGE];
+    int cls = pg->cls;
+    *(uint8_t*)p = pg->freeSlot;
+    pg->freeSlot = (off % BITVM_POOL_PAGE) / poolClassSize[cls];
+    poolStats.used[cls]--;
+    poolHint[cls] = off / BITVM_POOL_PAGE;
+    if (--pg->used == 0) {
+      pg->cls = BITVM_NO_SLOT;
+      poolStats.capacity[cls] -= BITVM_POOL_PAGE / poolClassSize[cls];
+    }
+  }
+
+  namespace pool {
+    // Bytes in free pages.
+    int freeBytes()
+    {
+      int n = 0;
+      for (int i = 0; i < BITVM_POOL_PAGES; ++i)
+        if (poolPages[i].cls == BITVM_NO_SLOT)
+          n += BITVM_POOL_PAGE;
+      return poolBase ? n : BITVM_POOL_SIZE;
+    }
+
+    // Longest run of free pages, in bytes.
+    int largestFreeBlock()
+    {
+      if (poolBase == NULL)
+        return BITVM_POOL_SIZE;
+      int best = 0, run = 0;
+      for (int i = 0; i < BITVM_POOL_PAGES; ++i) {
+        run = poolPages[i].cls == BITVM_NO_SLOT ? run + BITVM_POOL_PAGE : 0;
+        if (run > best)
+          best = run;
+      }
+      return best;
+    }
+
+    // External fragmentation in percent: 0 when all free memory is one block.
+    int fragmentation()
+    {
+      int total = freeBytes();
+      if (total == 0)
+        return 0;
+      return 100 - largestFreeBlock() * 100 / total;
+    }
+
+    // Percentage of slots in use among the pages holding size class [cls].
+    int occupancy(int cls)
+    {
+      if (cls < 0 || cls >= BITVM_POOL_CLASSES || poolStats.capacity[cls] == 0)
+        return 0;
+      return poolStats.used[cls] * 100 / poolStats.capacity[cls];
+    }
+
+    void dump()
+    {
+      printf("POOL free=%d largest=%d frag=%d%% fallbacks=%d\n",
+        freeBytes(), largestFreeBlock(), fragmentation(), poolStats.fallbacks);
+      for (int i = 0; i < BITVM_POOL_CLASSES; ++i)
+        if (poolStats.capacity[i])
+          printf("  %2d bytes: %d/%d\n", poolClassSize[i], poolStats.used[i], poolStats.capacity[i]);
+    }
+  }
+
+  // ---------------------------------------------------------------------------
+  // Scratch arena
+  // ---------------------------------------------------------------------------
+
+  // While an event handler runs, RefObjects are bump-allocated from a single
+  // block instead of the pool. The arena is reset once every object allocated
+  // from it is dead; an object that escapes the handler (stored in a global,
+  // say) keeps it pinned until it dies, and later allocations that don't fit
+  // go to the pool. Strings are not included - the DAL free()s them itself.
+  //
+  // So that one escaping object per run doesn't keep the arena pinned for
+  // good, a handler that leaves live objects behind in it doesn't get the
+  // arena again. Once BITVM_SCRATCH_LEAKY handlers have, the arena is given
+  // up altogether.
+#define BITVM_SCRATCH_LEAKY 8
+
+  static uint8_t *arenaBase;
+  static uint32_t arenaSize, arenaTop, arenaWanted;
+  static uint16_t arenaLive, arenaDepth;
+  static uint32_t leakyHandlers[BITVM_SCRATCH_LEAKY]; // source << 16 | value
+  static uint8_t numLeakyHandlers;
+  ScratchStats scratchStats;
+
+  // Under memory pressure an unused arena is given back to the heap; the next
+  // handler tries to get it again.
+  static void scratchShrink()
+  {
+    if (arenaBase != NULL && arenaLive == 0 && arenaDepth == 0) {
+      free(arenaBase);
+      arenaBase = NULL;
+      arenaSize = 0;
+    }
+  }
+
+  static inline bool inArena(void *p)
+  {
+    return arenaBase <= (uint8_t*)p && (uint8_t*)p < arenaBase + arenaSize;
+  }
+
+  INTERNAL void *allocRef(size_t sz)
+  {
+    sz = (sz + 3) & ~3;
+    if (arenaDepth > 0) {
+      if (arenaTop + sz <= arenaSize) {
+        void *r = arenaBase + arenaTop;
+        arenaTop += sz;
+        arenaLive++;
+        scratchStats.arenaAllocs++;
+        return r;
+      }
+      scratchStats.overflows++;
+    }
+    scratchStats.heapAllocs++;
+    void *r = poolAlloc(sz);
+    if (r)
+      return r;
+    poolStats.fallbacks++;
+    return heapAlloc(sz);
+  }
+
+  INTERNAL void freeRef(void *p)
+  {
+    TRACE_FREE(p);
+    if (inArena(p)) {
+      if (--arenaLive == 0) {
+        arenaTop = 0;
+        scratchStats.resets++;
+        if (arenaWanted == 0)
+          scratchShrink(); // given up on
+      }
+    } else if (inPool(p)) {
+      poolFree(p);
+    } else {
+      free(p);
+    }
+  }
+
+  namespace scratch {
+    // Opt-in; [size] bytes are taken from the heap and kept, unless memory
+    // runs low.
+    void enable(int size)
+    {
+      if (arenaWanted != 0 || size <= 0 || numLeakyHandlers == BITVM_SCRATCH_LEAKY)
+        return;
+      arenaWanted = (size + 3) & ~3;
+      registerShrinker(scratchShrink);
+    }
+
+    // Handlers of different fibers may interleave (when one of them pauses),
+    // so this is a depth count rather than a flag. Returns true when the
+    // handler of event [source]/[value] runs in the arena, in which case
+    // leave() has to follow.
+    static bool enter(int source, int value)
+    {
+      if (arenaWanted == 0)
+        return false;
+      uint32_t key = (source << 16) | (value & 0xffff);
+      for (int i = 0; i < numLeakyHandlers; ++i)
+        if (leakyHandlers[i] == key)
+          return false;
+      if (arenaBase == NULL && arenaWanted != 0 && !lowMemoryRaised) {
+        arenaBase = (uint8_t*)tryMalloc(arenaWanted);
+        arenaSize = arenaBase ? arenaWanted : 0;
+        arenaTop = 0;
+      }
+      if (arenaBase == NULL)
+        return false;
+      arenaDepth++;
+      return true;
+    }
+
+    // Only checked when no other handler is in the arena: any object still
+    // in it, other than dead ones waiting in the free queue, escaped.
+    static void leave(int source, int value)
+    {
+      if (--arenaDepth > 0 || arenaLive == 0)
+        return;
+      int dead = 0;
+      for (int i = 0; i < freeQueueLen; ++i)
+        if (inArena(freeQueue[(freeQueueHead + i) % BITVM_FREE_QUEUE_SIZE]))
+          dead++;
+      for (uint16_t l = freeOverflow; l; ) {
+        RefObject *o = overflowAt(l);
+        if (inArena(o))
+          dead++;
+        l = o->refcnt;
+      }
+      if (arenaLive == dead)
+        return;
+
+      scratchStats.escapes++;
+      if (numLeakyHandlers < BITVM_SCRATCH_LEAKY) {
+        leakyHandlers[numLeakyHandlers++] = (source << 16) | (value & 0xffff);
+      } else {
+        arenaWanted = 0;
+        scratchShrink();
+      }
+    }
+  }
+
   uint32_t ldloc(RefLocal *r)
   {
     return r->v;
@@ -37,7 +795,7 @@ namespace bitvm {
     r->v = v;
   }
 
-  void stlocRef(RefRefLocal *r, uint32_t v)
+  void stlocRef(RefRefLocal *r, OWNED uint32_t v)
   {
     decr(r->v);
     r->v = v;
@@ -45,43 +803,54 @@ namespace bitvm {
 
   RefLocal *mkloc()
   {
-    return new RefLocal();
+    gcPoll();
+    RefLocal *r = new RefLocal();
+    TRACE_ALLOC(ALLOC_LOCAL, r, sizeof(RefLocal));
+    return r;
   }
 
   RefRefLocal *mklocRef()
   {
-    return new RefRefLocal();
+    gcPoll();
+    RefRefLocal *r = new RefRefLocal();
+    TRACE_ALLOC(ALLOC_LOCAL, r, sizeof(RefRefLocal));
+    return r;
   }
 
   // All of the functions below unref() self. This is for performance reasons -
   // the code emitter will not emit the unrefs for them.
   
-  uint32_t ldfld(RefRecord *r, int idx)
+  uint32_t ldfld(OWNED RefRecord *r, int idx)
   {
     auto tmp = r->ld(idx);
     r->unref();
     return tmp;
   }
 
-  uint32_t ldfldRef(RefRecord *r, int idx)
+  uint32_t ldfldRef(OWNED RefRecord *r, int idx)
   {
     auto tmp = r->ldref(idx);
     r->unref();
     return tmp;
   }
 
-  void stfld(RefRecord *r, int idx, uint32_t val)
+  void stfld(OWNED RefRecord *r, int idx, uint32_t val)
   {
     r->st(idx, val);
     r->unref();
   }
 
-  void stfldRef(RefRecord *r, int idx, uint32_t val)
+  void stfldRef(OWNED RefRecord *r, int idx, OWNED uint32_t val)
   {
     r->stref(idx, val);
     r->unref();
   }
 
+#ifdef DEBUG_MEMLEAKS
+  // Bit i is set once global i has been stored as a reference, for heapSnapshot()
+  static uint8_t *refGlobals;
+#endif
+
   uint32_t ldglb(int idx)
   {
     check(0 <= idx && idx < numGlobals, ERR_OUT_OF_BOUNDS, 7);
@@ -108,38 +877,127 @@ namespace bitvm {
     globals[idx] = v;
   }
 
-  void stglbRef(uint32_t v, int idx)
+  void stglbRef(OWNED uint32_t v, int idx)
   {
     check(0 <= idx && idx < numGlobals, ERR_OUT_OF_BOUNDS, 7);
     decr(globals[idx]);
     globals[idx] = v;
+#ifdef DEBUG_MEMLEAKS
+    // the emitter only uses the Ref variant for reference-typed globals
+    refGlobals[idx >> 3] |= 1 << (idx & 7);
+#endif
   }
 
-  // Store a captured local in a closure. It returns the action, so it can be chained.
-  RefAction *stclo(RefAction *a, int idx, uint32_t v)
+  // The last closure created by each lambda expression is remembered, in a
+  // small direct-mapped table. While it's alive, the next evaluation of the
+  // same lambda hands it out again rather than allocating a new one, and the
+  // stclo() calls that follow check the captured values against it. Closures
+  // never change once built, so sharing one with matching values is safe; on
+  // the first value that differs, stclo() makes a copy and carries on with
+  // that. This takes the churn out of handlers (re-)registered in loops and
+  // forever bodies. The table holds no references.
+  RefAction *closureCache[BITVM_CLOSURE_CACHE];
+  ClosureCacheStats closureCacheStats;
+
+  // Fused shims for common emitter sequences. Each replaces several calls,
+  // and skips the incr()/decr() of the values passed between them.
+
+  // r.fields[idx] += delta, for r.x := r.x + 1 and the like; unref()s r like
+  // stfld() does
+  void incrField(OWNED RefRecord *r, int idx, int delta)
   {
-    //DBG("STCLO "); a->print(); DBG("@%d = %p\n", idx, (void*)v);
-    a->st(idx, v);
-    return a;
+    check(r->reflen <= idx && idx < r->len, ERR_OUT_OF_BOUNDS, 3);
+    r->fields[idx] += delta;
+    r->unref();
   }
 
-  // This one is used for testing in 'bitvm test0'
-  uint32_t const3() { return 3; }
+  void incrGlobal(int idx, int delta)
+  {
+    check(0 <= idx && idx < numGlobals, ERR_OUT_OF_BOUNDS, 7);
+    globals[idx] += delta;
+  }
 
-#ifdef DEBUG_MEMLEAKS
-  std::set<RefObject*> allptrs;
-  void debugMemLeaks()
+  // Field [fld] of the record in global [idx]
+  uint32_t ldglbField(int idx, int fld)
   {
-    printf("LIVE POINTERS:\n");
-    for(std::set<RefObject*>::iterator itr = allptrs.begin();itr!=allptrs.end();itr++)
-    {
-      (*itr)->print();
-    }    
-    printf("\n");
+    check(0 <= idx && idx < numGlobals, ERR_OUT_OF_BOUNDS, 7);
+    return ((RefRecord*)globals[idx])->ld(fld);
   }
-#else
-  void debugMemLeaks() {}
-#endif
+
+  uint32_t ldglbFieldRef(int idx, int fld)
+  {
+    check(0 <= idx && idx < numGlobals, ERR_OUT_OF_BOUNDS, 7);
+    return ((RefRecord*)globals[idx])->ldref(fld);
+  }
+
+  // Size of, and elements of, the collection in global [idx]
+  int globalCollectionCount(int idx)
+  {
+    check(0 <= idx && idx < numGlobals, ERR_OUT_OF_BOUNDS, 7);
+    return ((RefCollection*)globals[idx])->data.size();
+  }
+
+  uint32_t globalCollectionAt(int idx, int x)
+  {
+    check(0 <= idx && idx < numGlobals, ERR_OUT_OF_BOUNDS, 7);
+    RefCollection *c = (RefCollection*)globals[idx];
+    check(0 <= x && x < (int)c->data.size(), ERR_OUT_OF_BOUNDS, 13);
+    uint32_t tmp = c->data[x];
+    if (c->flags & 1) incr(tmp);
+    return tmp;
+  }
+
+  // Store a captured local in a closure. It returns the action, so it can be
+  // chained; that's a copy when [a] came from the closure cache and [v]
+  // differs from what it holds.
+  RefAction *stclo(OWNED RefAction *a, int idx, OWNED uint32_t v)
+  {
+    //DBG("STCLO "); a->print(); DBG("@%d = %p\n", idx, (void*)v);
+    check(0 <= idx && idx < a->len, ERR_OUT_OF_BOUNDS, 12);
+    if (a->refcnt > 1 && a->fields[idx] != v) {
+      // shared, so it came from the cache; don't touch it
+      closureCacheStats.copies++;
+      gcPoll();
+      void *ptr = allocRef(sizeof(RefAction) + a->len * sizeof(uint32_t));
+      RefAction *r = new (ptr) RefAction();
+      r->len = a->len;
+      r->reflen = a->reflen;
+      r->func = a->func;
+      for (int i = 0; i < a->len; ++i) {
+        r->fields[i] = a->fields[i];
+        if (i < a->reflen)
+          incr(r->fields[i]);
+      }
+      TRACE_ALLOC(ALLOC_ACTION, r, sizeof(RefAction) + r->len * sizeof(uint32_t));
+      closureCache[closureSlot(r->func)] = r;
+      a->unref();
+      a = r;
+    }
+    // Values not stored yet are 0 in a new closure; in a copy, or a cached
+    // one with matching values, the old value is dropped.
+    if (idx < a->reflen)
+      decr(a->fields[idx]);
+    a->fields[idx] = v;
+    return a;
+  }
+
+  // This one is used for testing in 'bitvm test0'
+  uint32_t const3() { return 3; }
+
+#ifdef DEBUG_MEMLEAKS
+  std::set<RefObject*> allptrs;
+  void debugMemLeaks()
+  {
+    printf("LIVE POINTERS:\n");
+    for(std::set<RefObject*>::iterator itr = allptrs.begin();itr!=allptrs.end();itr++)
+    {
+      (*itr)->print();
+    }    
+    printf("\n");
+  }
+#else
+  void debugMemLeaks() {}
+#endif
 
   namespace bitvm_number {
     void post_to_wall(int n) { printf("%d\n", n); }
@@ -196,250 +1054,1135 @@ namespace bitvm {
       return ManagedString((char)ManagedString(s).charAt(i)).leakData();
     }
 
-    int to_character_code(StringData *s) {
-      return ManagedString(s).charAt(0);
-    }
+    int to_character_code(StringData *s) {
+      return ManagedString(s).charAt(0);
+    }
+
+    int code_at(StringData *s, int i) {
+      return ManagedString(s).charAt(i);
+    }
+
+    int to_number(StringData *s) {
+      return atoi(s->data);
+    }
+
+    void post_to_wall(StringData *s) { printf("%s\n", s->data); }
+  }
+
+  namespace bitvm_boolean {
+    // Cache the string literals "true" and "false" when used.
+    // Note that the representation of booleans stays the usual C-one.
+    
+    static const char sTrue[]  __attribute__ ((aligned (4))) = "\xff\xff\x04\x00" "true\0";
+    static const char sFalse[] __attribute__ ((aligned (4))) = "\xff\xff\x05\x00" "false\0";
+
+    StringData *to_string(int v)
+    {
+      if (v) {
+        return (StringData*)(void*)sTrue;
+      } else {
+        return (StringData*)(void*)sFalse;
+      }            
+    }
+  }
+
+  StringData *mkStringData(uint32_t len)
+  {
+    gcPoll();
+    StringData *r = (StringData*)heapAlloc(sizeof(StringData)+len+1);
+    r->init();
+    r->len = len;
+    memset(r->data, '\0', len + 1);
+    TRACE_ALLOC(ALLOC_STRING, r, sizeof(StringData) + len + 1);
+    return r;
+  }
+
+  // The proper StringData* representation is already laid out in memory by the code generator.
+  uint32_t stringData(uint32_t lit)
+  {
+    return (uint32_t)getstr(lit);
+  }
+
+
+  namespace collection {
+
+    RefCollection *mk(uint32_t flags)
+    {
+      gcPoll();
+      RefCollection *r = new RefCollection(flags);
+      TRACE_ALLOC(ALLOC_COLLECTION, r, sizeof(RefCollection));
+      return r;
+    }
+
+    int count(RefCollection *c) { return c->data.size(); }
+
+    void add(RefCollection *c, uint32_t x) {
+      if (c->flags & 1) incr(x);
+      c->data.push_back(x);
+    }
+
+    inline bool in_range(RefCollection *c, int x) {
+      return (0 <= x && x < (int)c->data.size());
+    }
+
+    uint32_t at(RefCollection *c, int x) {
+      if (in_range(c, x)) {
+        uint32_t tmp = c->data.at(x);
+        if (c->flags & 1) incr(tmp);
+        return tmp;
+      }
+      else {
+        error(ERR_OUT_OF_BOUNDS);
+        return 0;
+      }
+    }
+
+    // c[x].fields[idx], for collections of records
+    uint32_t atField(RefCollection *c, int x, int idx) {
+      check(in_range(c, x), ERR_OUT_OF_BOUNDS, 14);
+      return ((RefRecord*)c->data[x])->ld(idx);
+    }
+
+    uint32_t atFieldRef(RefCollection *c, int x, int idx) {
+      check(in_range(c, x), ERR_OUT_OF_BOUNDS, 14);
+      return ((RefRecord*)c->data[x])->ldref(idx);
+    }
+
+    void incrAtField(RefCollection *c, int x, int idx, int delta) {
+      check(in_range(c, x), ERR_OUT_OF_BOUNDS, 14);
+      RefRecord *r = (RefRecord*)c->data[x];
+      check(r->reflen <= idx && idx < r->len, ERR_OUT_OF_BOUNDS, 3);
+      r->fields[idx] += delta;
+    }
+
+    void remove_at(RefCollection *c, int x) {
+      if (!in_range(c, x))
+        return;
+
+      if (c->flags & 1) decr(c->data.at(x));
+      c->data.erase(c->data.begin()+x);
+    }
+
+    void set_at(RefCollection *c, int x, uint32_t y) {
+      if (!in_range(c, x))
+        return;
+
+      if (c->flags & 1) {
+        decr(c->data.at(x));
+        incr(y);
+      }
+      c->data.at(x) = y;
+    }
+
+    int index_of(RefCollection *c, uint32_t x, int start) {
+      if (!in_range(c, start))
+        return -1;
+
+      if (c->flags & 2) {
+        StringData *xx = (StringData*)x;
+        for (uint32_t i = start; i < c->data.size(); ++i) {
+          StringData *ee = (StringData*)c->data.at(i);
+          if (xx->len == ee->len && memcmp(xx->data, ee->data, xx->len) == 0)
+            return (int)i;
+        }
+      } else if ((c->flags & 1) && !isImmortal(x) && hasVTable(x)) {
+        // extension types may define their own equality
+        RefObject *xx = (RefObject*)x;
+        for (uint32_t i = start; i < c->data.size(); ++i) {
+          uint32_t e = c->data.at(i);
+          if (e == x || (!isImmortal(e) && hasVTable(e) && xx->equals((RefObject*)e)))
+            return (int)i;
+        }
+      } else {
+        for (uint32_t i = start; i < c->data.size(); ++i)
+          if (c->data.at(i) == x)
+            return (int)i;
+      }
+
+      return -1;
+    }
+
+    int remove(RefCollection *c, uint32_t x) {
+      int idx = index_of(c, x, 0);
+      if (idx >= 0) {
+        remove_at(c, idx);
+        return 1;
+      }
+
+      return 0;
+    }
+  }
+
+  namespace buffer {
+
+    RefBuffer *mk(uint32_t size)
+    {
+      gcPoll();
+      RefBuffer *r = new RefBuffer();
+      r->data.resize(size);
+      TRACE_ALLOC(ALLOC_BUFFER, r, sizeof(RefBuffer));
+      return r;
+    }
+
+    char *cptr(RefBuffer *c)
+    {
+      return (char*)&c->data[0];
+    }
+
+    int count(RefBuffer *c) { return c->data.size(); }
+
+    void fill(RefBuffer *c, int v)
+    {
+      memset(cptr(c), v, count(c));
+    }
+
+    void fill_random(RefBuffer *c)
+    {
+      int len = count(c);
+      for (int i = 0; i < len; ++i)
+        c->data[i] = uBit.random(0x100);
+    }
+
+    void add(RefBuffer *c, uint32_t x) {
+      c->data.push_back(x);
+    }
+
+    inline bool in_range(RefBuffer *c, int x) {
+      return (0 <= x && x < (int)c->data.size());
+    }
+
+    uint32_t at(RefBuffer *c, int x) {
+      if (in_range(c, x)) {
+        return c->data[x];
+      }
+      else {
+        error(ERR_OUT_OF_BOUNDS);
+        return 0;
+      }
+    }
+
+    void set(RefBuffer *c, int x, uint32_t y) {
+      if (!in_range(c, x))
+        return;
+      c->data[x] = y;
+    }
+
+    // For building argument tuples for batched GLUE functions.
+    ATOMIC void add_int16(RefBuffer *c, int x) {
+      c->data.push_back(x & 0xff);
+      c->data.push_back((x >> 8) & 0xff);
+    }
+
+    ATOMIC void set_int16(RefBuffer *c, int idx, int x) {
+      if (!in_range(c, idx * 2 + 1))
+        return;
+      c->data[idx * 2] = x & 0xff;
+      c->data[idx * 2 + 1] = (x >> 8) & 0xff;
+    }
+  }
+
+  namespace bitvm_bits {
+    RefBuffer *create_buffer(int size)
+    {
+      return buffer::mk(size);
+    }
+  }
+
+  // Shared by record::mk() and env::mk(); T is RefRecord or RefEnv.
+  template <class T>
+  static T *mkFields(int reflen, int totallen, AllocKind kind)
+  {
+    check(0 <= reflen && reflen <= totallen, ERR_SIZE, 1);
+    check(reflen <= totallen && totallen <= 255, ERR_SIZE, 2);
+
+    gcPoll();
+    void *ptr = allocRef(sizeof(T) + totallen * sizeof(uint32_t));
+    T *r = new (ptr) T();
+    r->len = totallen;
+    r->reflen = reflen;
+    memset(r->fields, 0, r->len * sizeof(uint32_t));
+    TRACE_ALLOC(kind, r, sizeof(T) + totallen * sizeof(uint32_t));
+    return r;
+  }
+
+  namespace record {
+    RefRecord* mk(int reflen, int totallen)
+    {
+      return mkFields<RefRecord>(reflen, totallen, ALLOC_RECORD);
+    }
+  }
+
+  // Unlike ldfld() and friends, the accessors here do not unref() the
+  // environment - it's held by the closure (or the scope) that uses it.
+  namespace env {
+    RefEnv* mk(int reflen, int totallen)
+    {
+      return mkFields<RefEnv>(reflen, totallen, ALLOC_ENV);
+    }
+
+    uint32_t ld(RefEnv *e, int idx)
+    {
+      return e->ld(idx);
+    }
+
+    uint32_t ldRef(RefEnv *e, int idx)
+    {
+      return e->ldref(idx);
+    }
+
+    void st(RefEnv *e, int idx, uint32_t v)
+    {
+      e->st(idx, v);
+    }
+
+    void stRef(RefEnv *e, int idx, OWNED uint32_t v)
+    {
+      e->stref(idx, v);
+    }
+  }
+
+#ifndef BITVM_MAX_EXT_TYPES
+#define BITVM_MAX_EXT_TYPES 8
+#endif
+
+  static const char *extTypeNames[BITVM_MAX_EXT_TYPES];
+  static int numExtTypes;
+
+  REFTYPE RefExtension::registerType(const char *name)
+  {
+    check(numExtTypes < BITVM_MAX_EXT_TYPES, ERR_SIZE, 3);
+    extTypeNames[numExtTypes] = name;
+    return (REFTYPE)(REF_EXTENSION + numExtTypes++);
+  }
+
+  const char *RefExtension::typeName(REFTYPE type)
+  {
+    int idx = type - REF_EXTENSION;
+    if (0 <= idx && idx < numExtTypes)
+      return extTypeNames[idx];
+    return "RefExtension";
+  }
+
+  typedef uint32_t Action;
+
+  namespace action {
+    Action mk(int reflen, int totallen, int startptr)
+    {
+      check(0 <= reflen && reflen <= totallen, ERR_SIZE, 1);
+      check(reflen <= totallen && totallen <= 255, ERR_SIZE, 2);
+      check(bytecode[startptr] == 0xffff, ERR_INVALID_BINARY_HEADER, 3);
+      check(bytecode[startptr + 1] == 0, ERR_INVALID_BINARY_HEADER, 4);
+
+
+      uint32_t tmp = (uint32_t)&bytecode[startptr];
+
+      if (totallen == 0) {
+        return tmp; // no closure needed
+      }
+
+      ActionCB func = (ActionCB)((tmp + 4) | 1);
+      RefAction **slot = &closureCache[closureSlot(func)];
+      RefAction *r = *slot;
+      // a dead closure (refcnt 0) may still be waiting in the free queue
+      if (r != NULL && r->func == func && r->len == totallen && r->refcnt > 0) {
+        closureCacheStats.hits++;
+        r->ref();
+        return (Action)r;
+      }
+      closureCacheStats.misses++;
+
+      gcPoll();
+      void *ptr = allocRef(sizeof(RefAction) + totallen * sizeof(uint32_t));
+      r = new (ptr) RefAction();
+      r->len = totallen;
+      r->reflen = reflen;
+      r->func = func;
+      memset(r->fields, 0, r->len * sizeof(uint32_t));
+      TRACE_ALLOC(ALLOC_ACTION, r, sizeof(RefAction) + totallen * sizeof(uint32_t));
+
+      *slot = r;
+
+      return (Action)r;
+    }
+
+    void run1(Action a, int arg)
+    {
+      if (hasVTable(a))
+        ((RefAction*)a)->run(arg);
+      else {
+        check(*(uint16_t*)a == 0xffff, ERR_INVALID_BINARY_HEADER, 4);
+        ((ActionCB)((a + 4) | 1))(NULL, NULL, arg);
+      }
+    }
+
+    void run(Action a)
+    {
+      action::run1(a, 0);
+    }
+
+    // Entry points for lambdas taking several arguments, and for those that
+    // return a value (which are also what native code uses to call back into
+    // the program). See RefAction for who owns what.
+    static uint32_t invoke(Action a, uint32_t arg0, uint32_t arg1, uint32_t arg2)
+    {
+      if (hasVTable(a))
+        return ((RefAction*)a)->run3(arg0, arg1, arg2);
+      check(*(uint16_t*)a == 0xffff, ERR_INVALID_BINARY_HEADER, 4);
+      return ((ActionCB3)((a + 4) | 1))(NULL, NULL, arg0, arg1, arg2);
+    }
+
+    void run2(Action a, int arg0, int arg1)
+    {
+      invoke(a, arg0, arg1, 0);
+    }
+
+    void run3(Action a, int arg0, int arg1, int arg2)
+    {
+      invoke(a, arg0, arg1, arg2);
+    }
+
+    uint32_t call0(Action a)
+    {
+      return invoke(a, 0, 0, 0);
+    }
+
+    uint32_t call1(Action a, int arg)
+    {
+      return invoke(a, arg, 0, 0);
+    }
+
+    uint32_t call2(Action a, int arg0, int arg1)
+    {
+      return invoke(a, arg0, arg1, 0);
+    }
+
+    // How the closure cache is doing; see closureCacheStats.
+    int cache_hits()
+    {
+      return closureCacheStats.hits;
+    }
+
+    int cache_misses()
+    {
+      return closureCacheStats.misses;
+    }
+
+    int cache_copies()
+    {
+      return closureCacheStats.copies;
+    }
+  }
+
+  // ---------------------------------------------------------------------------
+  // Stopwatch
+  // ---------------------------------------------------------------------------
+
+  // micro_bit::getCurrentTime() is in milliseconds, which is too coarse to time
+  // most code. These run off us_ticker_read(), in microseconds, but on the
+  // nRF51 mbed drives it from RTC1 at 32768Hz, so it moves in steps of about
+  // 30.5us (SysTick, much finer, under the QEMU stub DAL). A lap is the time
+  // since the previous lap, or since start(); time spent stopped is not
+  // counted in either.
+  namespace stopwatch {
+    RefStopwatch *mk()
+    {
+      gcPoll();
+      RefStopwatch *r = new RefStopwatch();
+      TRACE_ALLOC(ALLOC_STOPWATCH, r, sizeof(RefStopwatch));
+      return r;
+    }
+
+    void start(RefStopwatch *sw)
+    {
+      if (sw->running)
+        return;
+      sw->startUs = sw->lapStartUs = us_ticker_read();
+      sw->running = true;
+    }
+
+    void stop(RefStopwatch *sw)
+    {
+      if (!sw->running)
+        return;
+      sw->elapsedUs += us_ticker_read() - sw->startUs;
+      sw->running = false;
+    }
+
+    void reset(RefStopwatch *sw)
+    {
+      sw->running = false;
+      sw->elapsedUs = 0;
+      sw->laps = 0;
+      sw->lapTotalUs = 0;
+      sw->lapMinUs = 0;
+    }
+
+    // Total running time, in microseconds.
+    int elapsed(RefStopwatch *sw)
+    {
+      uint32_t r = sw->elapsedUs;
+      if (sw->running)
+        r += us_ticker_read() - sw->startUs;
+      return r;
+    }
+
+    // Ends the current lap and returns its length; 0 if the stopwatch isn't
+    // running.
+    int lap(RefStopwatch *sw)
+    {
+      if (!sw->running)
+        return 0;
+      uint32_t now = us_ticker_read();
+      uint32_t len = now - sw->lapStartUs;
+      sw->lapStartUs = now;
+      if (sw->laps == 0 || len < sw->lapMinUs)
+        sw->lapMinUs = len;
+      sw->laps++;
+      sw->lapTotalUs += len;
+      return len;
+    }
+
+    int laps(RefStopwatch *sw)
+    {
+      return sw->laps;
+    }
+
+    int min_lap(RefStopwatch *sw)
+    {
+      return sw->lapMinUs;
+    }
+
+    int mean_lap(RefStopwatch *sw)
+    {
+      return sw->laps ? sw->lapTotalUs / sw->laps : 0;
+    }
+
+    // Runs [a] [iterations] times, one lap each, and returns the stopped
+    // stopwatch; mean_lap() and min_lap() are the results. Each lap includes
+    // the call itself and one us_ticker_read() - time an empty action to see
+    // how much. On the device min_lap() is a multiple of the timer's 30.5us
+    // step; the laps add up to the total, so mean_lap() gets finer with more
+    // iterations.
+    RefStopwatch *benchmark(Action a, int iterations)
+    {
+      RefStopwatch *sw = mk();
+      if (a == 0)
+        return sw;
+      start(sw);
+      for (int i = 0; i < iterations; ++i) {
+        action::run(a);
+        lap(sw);
+      }
+      stop(sw);
+      return sw;
+    }
+  }
+
+
+  // ---------------------------------------------------------------------------
+  // ISR event queue
+  // ---------------------------------------------------------------------------
+
+  // A single-producer, single-consumer ring. The producer is interrupt code
+  // (one priority level only - handlers at the same level don't preempt each
+  // other), and it only ever writes isrQueueHead; the dispatcher fiber only
+  // writes isrQueueTail. Neither side needs to disable interrupts.
+#ifndef BITVM_ISR_QUEUE_SIZE
+#define BITVM_ISR_QUEUE_SIZE 16
+#endif
+
+  struct IsrEvent {
+    uint16_t id;
+    uint16_t value;
+    uint32_t time;
+  };
+
+  static IsrEvent isrQueue[BITVM_ISR_QUEUE_SIZE];
+  static volatile uint8_t isrQueueHead, isrQueueTail;
+  IsrQueueStats isrQueueStats;
+
+  namespace isr {
+    bool post(uint16_t id, uint16_t value)
+    {
+      uint8_t head = isrQueueHead;
+      uint8_t next = (head + 1) % BITVM_ISR_QUEUE_SIZE;
+      isrQueueStats.posted++;
+      if (next == isrQueueTail) {
+        isrQueueStats.overflows++;
+        return false;
+      }
+      isrQueue[head].id = id;
+      isrQueue[head].value = value;
+      isrQueue[head].time = us_ticker_read();
+      // the entry has to be written before the dispatcher can see it
+      __asm volatile("" ::: "memory");
+      isrQueueHead = next;
+      return true;
+    }
+  }
+
+  // The events go through the message bus, and so to handlers registered
+  // with registerWithDal(), like any other event.
+  static void isrDispatcher()
+  {
+    while (true) {
+      while (isrQueueTail != isrQueueHead) {
+        IsrEvent e = isrQueue[isrQueueTail];
+        __asm volatile("" ::: "memory");
+        isrQueueTail = (isrQueueTail + 1) % BITVM_ISR_QUEUE_SIZE;
+
+        uint32_t latency = us_ticker_read() - e.time;
+        isrQueueStats.sumLatencyUs += latency;
+        if (latency > isrQueueStats.maxLatencyUs)
+          isrQueueStats.maxLatencyUs = latency;
+
+        MicroBitEvent evt(e.id, e.value);
+      }
+      fiber_wait_for_event(BITVM_ID_RUNTIME, BITVM_EVT_ISR_QUEUE);
+    }
+  }
+
+  // Interrupts end with the idle fiber (or another one) running, not the
+  // dispatcher; the idle fiber wakes it up. Raising the event from here,
+  // rather than from post(), keeps the message bus out of interrupt context.
+  // The dispatcher fiber is only created once there is something to
+  // dispatch, so programs that never see an isr::post() don't pay for its
+  // stack.
+  static bool isrDispatcherStarted;
+
+  class IsrQueueIdle : public MicroBitComponent
+  {
+  public:
+    virtual void idleTick()
+    {
+      if (isrQueueTail != isrQueueHead) {
+        if (!isrDispatcherStarted) {
+          isrDispatcherStarted = true;
+          create_fiber(isrDispatcher); // drains the queue before it first waits
+          return;
+        }
+        MicroBitEvent evt(BITVM_ID_RUNTIME, BITVM_EVT_ISR_QUEUE);
+      }
+    }
+
+    virtual int isIdleCallbackNeeded()
+    {
+      return isrQueueTail != isrQueueHead;
+    }
+  };
+
+  static IsrQueueIdle isrQueueIdle;
+
+  // The DAL has room for MICROBIT_IDLE_COMPONENTS idle components, raised in
+  // MicroBitCustomConfig.h for the runtime's. Should an extension have taken
+  // the room anyway, a fiber ticks the ones that didn't fit, every scheduler
+  // tick, so that dead objects and ISR events don't pile up unseen.
+#define BITVM_IDLE_FALLBACKS 2
+#define BITVM_IDLE_POLL_MS 6
+
+  static MicroBitComponent *idleFallbacks[BITVM_IDLE_FALLBACKS];
+
+  static void idleFallbackFiber()
+  {
+    while (true) {
+      for (int i = 0; i < BITVM_IDLE_FALLBACKS && idleFallbacks[i]; ++i)
+        idleFallbacks[i]->idleTick();
+      fiber_sleep(BITVM_IDLE_POLL_MS);
+    }
+  }
+
+  static void addIdleWork(MicroBitComponent *c)
+  {
+    if (uBit.addIdleComponent(c) == MICROBIT_OK)
+      return;
+    printf("No room for an idle component, polling instead\n");
+    for (int i = 0; i < BITVM_IDLE_FALLBACKS; ++i)
+      if (idleFallbacks[i] == NULL) {
+        idleFallbacks[i] = c;
+        if (i == 0)
+          create_fiber(idleFallbackFiber);
+        return;
+      }
+  }
+
+
+  // ---------------------------------------------------------------------------
+  // Crash records
+  // ---------------------------------------------------------------------------
+
+  // error(), die() and micro_bit::panic() save the state of the runtime to a
+  // flash page before panicking, and the next exec_binary() prints it over
+  // serial, once. The page sits below the DAL's storage (17) and scratch (19)
+  // pages, counting from the end of flash. Nothing reserves it: it's only free
+  // while the firmware and the program end below it, so a page that is
+  // neither blank nor a crash record is left alone.
+  //
+  // A program that fails at startup crashes again after every reset, and a
+  // page only takes about 20000 erases. The page is kept as it is while it
+  // holds a record that hasn't been printed yet, or one of the same failure.
+  //
+  // With the SoftDevice running, the NVMC can't be written directly. When
+  // crashing it's disabled first - Bluetooth is going away anyway. At boot the
+  // "reported" word is cleared through sd_flash_write(), without waiting for
+  // it; clearing bits needs no erase.
+#ifndef BITVM_CRASH_PAGE_OFFSET
+#define BITVM_CRASH_PAGE_OFFSET 20
+#endif
+#define BITVM_CRASH_MAGIC 0xBC0DEAD1
+#define BITVM_CRASH_EVENTS 8
+#define BITVM_CRASH_STACK_WORDS 32
+
+  struct CrashEvent {
+    uint16_t source;
+    uint16_t value;
+    uint32_t time;  // ms
+  };
 
-    int code_at(StringData *s, int i) {
-      return ManagedString(s).charAt(i);
-    }
+  struct CrashRecord {
+    uint32_t magic;
+    uint32_t reported;  // 0xffffffff until printed
+    uint32_t checksum;  // of everything below
+    int32_t code;
+    int32_t subcode;
+    uint32_t time;      // ms since boot
+    uint32_t program;   // programHash()
+    uint16_t freeHeap;    // largest free block, at the last sample
+    uint16_t lowestHeap;
+    uint16_t poolLive;  // RefObjects in the pool
+    uint16_t freeQueued;
+    uint32_t heapAllocs;  // RefObjects allocated so far, all told
+    uint32_t fiber;     // currentFiber
+    uint32_t sp;
+    uint16_t numEvents;
+    uint16_t numStackWords;
+    CrashEvent events[BITVM_CRASH_EVENTS];  // oldest first
+    uint32_t stack[BITVM_CRASH_STACK_WORDS];  // from sp up
+  };
 
-    int to_number(StringData *s) {
-      return atoi(s->data);
-    }
+  extern "C" uint32_t __StackTop;
 
-    void post_to_wall(StringData *s) { printf("%s\n", s->data); }
+  static CrashEvent recentEvents[BITVM_CRASH_EVENTS];
+  static uint8_t recentEventsPos, recentEventsLen;
+  static bool crashSaved;
+
+  // Called for every event dispatched to TD code.
+  static inline void noteEvent(uint16_t source, uint16_t value)
+  {
+    CrashEvent &e = recentEvents[recentEventsPos];
+    e.source = source;
+    e.value = value;
+    e.time = uBit.systemTime();
+    recentEventsPos = (recentEventsPos + 1) % BITVM_CRASH_EVENTS;
+    if (recentEventsLen < BITVM_CRASH_EVENTS)
+      recentEventsLen++;
   }
 
-  namespace bitvm_boolean {
-    // Cache the string literals "true" and "false" when used.
-    // Note that the representation of booleans stays the usual C-one.
-    
-    static const char sTrue[]  __attribute__ ((aligned (4))) = "\xff\xff\x04\x00" "true\0";
-    static const char sFalse[] __attribute__ ((aligned (4))) = "\xff\xff\x05\x00" "false\0";
+  static CrashRecord *crashPage()
+  {
+    return (CrashRecord*)((NRF_FICR->CODESIZE - BITVM_CRASH_PAGE_OFFSET) * NRF_FICR->CODEPAGESIZE);
+  }
 
-    StringData *to_string(int v)
-    {
-      if (v) {
-        return (StringData*)(void*)sTrue;
-      } else {
-        return (StringData*)(void*)sFalse;
-      }            
-    }
+  static uint32_t crashChecksum(const CrashRecord *r)
+  {
+    const uint32_t *p = &r->checksum + 1;
+    const uint32_t *end = (const uint32_t*)(r + 1);
+    uint32_t h = 2166136261u;
+    while (p < end)
+      h = (h ^ *p++) * 16777619u;
+    return h;
   }
 
-  StringData *mkStringData(uint32_t len)
+  static inline void nvmcWait()
   {
-    StringData *r = (StringData*)malloc(sizeof(StringData)+len+1);
-    r->init();
-    r->len = len;
-    memset(r->data, '\0', len + 1);
-    return r;
+    while (NRF_NVMC->READY == NVMC_READY_READY_Busy)
+      ;
   }
 
-  // The proper StringData* representation is already laid out in memory by the code generator.
-  uint32_t stringData(uint32_t lit)
+  static void nvmcConfig(uint32_t mode)
   {
-    return (uint32_t)getstr(lit);
+    NRF_NVMC->CONFIG = mode;
+    nvmcWait();
   }
 
+  // This may run in interrupt context (the watchdog), or with the heap in a
+  // bad state, so it doesn't allocate; the heap figures are the ones
+  // memoryCheck() last recorded.
+  static void writeCrashRecord(int code, int subcode)
+  {
+    // Only the first failure is interesting, and this must not recurse.
+    if (crashSaved)
+      return;
+    crashSaved = true;
+
+    static CrashRecord r;
+    memset(&r, 0, sizeof(r));
+    r.magic = BITVM_CRASH_MAGIC;
+    r.reported = 0xffffffff;
+    r.code = code;
+    r.subcode = subcode;
+    r.time = uBit.systemTime();
+    r.program = bytecode ? programHash() : 0;
+    r.freeHeap = heapHistoryLen ? heapHistory[heapHistoryPos] : 0;
+    r.lowestHeap = heapLowest;
+    for (int i = 0; i < BITVM_POOL_CLASSES; ++i)
+      r.poolLive += poolStats.used[i];
+    r.freeQueued = freeQueueLen;
+    r.heapAllocs = scratchStats.heapAllocs;
+    r.fiber = (uint32_t)currentFiber;
+
+    for (int i = 0; i < recentEventsLen; ++i)
+      r.events[i] = recentEvents[(recentEventsPos + BITVM_CRASH_EVENTS - recentEventsLen + i) % BITVM_CRASH_EVENTS];
+    r.numEvents = recentEventsLen;
+
+    // A local's address is as good as the stack pointer here. Every fiber runs
+    // on the main stack (the DAL swaps stacks by copying), so it ends at
+    // __StackTop.
+    uint32_t marker = 0;
+    uint32_t *sp = &marker;
+    r.sp = (uint32_t)sp;
+    while (r.numStackWords < BITVM_CRASH_STACK_WORDS && sp < &__StackTop)
+      r.stack[r.numStackWords++] = *sp++;
+
+    r.checksum = crashChecksum(&r);
+
+    CrashRecord *page = crashPage();
+    if (page->magic == BITVM_CRASH_MAGIC) {
+      if (page->reported == 0xffffffff ||
+          (page->code == r.code && page->subcode == r.subcode && page->program == r.program))
+        return;
+    } else if (page->magic != 0xffffffff) {
+      return;
+    }
+
+    uint8_t sdEnabled = 0;
+    sd_softdevice_is_enabled(&sdEnabled);
+    if (sdEnabled)
+      sd_softdevice_disable();
+
+    nvmcConfig(NVMC_CONFIG_WEN_Een);
+    NRF_NVMC->ERASEPAGE = (uint32_t)page;
+    nvmcWait();
+    nvmcConfig(NVMC_CONFIG_WEN_Wen);
+    const uint32_t *src = (const uint32_t*)&r;
+    uint32_t *dst = (uint32_t*)page;
+    for (unsigned i = 0; i < sizeof(r) / 4; ++i) {
+      dst[i] = src[i];
+      nvmcWait();
+    }
+    nvmcConfig(NVMC_CONFIG_WEN_Ren);
+  }
 
-  namespace collection {
+  INTERNAL void saveCrashRecord(int code, int subcode)
+  {
+    writeCrashRecord(code, subcode);
+  }
 
-    RefCollection *mk(uint32_t flags)
-    {
-      RefCollection *r = new RefCollection(flags);
-      return r;
+  // Prints the crash record left by the previous run, if it hasn't been yet.
+  static void reportCrashRecord()
+  {
+    CrashRecord *r = crashPage();
+    if (r->magic != BITVM_CRASH_MAGIC || r->reported != 0xffffffff)
+      return;
+    if (r->checksum != crashChecksum(r)) {
+      printf("Crash record: bad checksum\n");
+    } else {
+      printf("Crash record: error %d [%d] at %dms, program %x\n",
+             r->code, r->subcode, r->time, r->program);
+      printf("  largest free block %d (lowest %d), %d pool objects, %d queued for freeing, %d allocated\n",
+             r->freeHeap, r->lowestHeap, r->poolLive, r->freeQueued, r->heapAllocs);
+      printf("  fiber %p, sp %p\n", (void*)r->fiber, (void*)r->sp);
+      for (int i = 0; i < r->numEvents && i < BITVM_CRASH_EVENTS; ++i)
+        printf("  event %d/%d at %dms\n", r->events[i].source, r->events[i].value, r->events[i].time);
+      for (int i = 0; i < r->numStackWords && i < BITVM_CRASH_STACK_WORDS; i += 4)
+        printf("  %p: %08x %08x %08x %08x\n", (void*)(r->sp + i * 4),
+               r->stack[i], r->stack[i + 1], r->stack[i + 2], r->stack[i + 3]);
+    }
+
+    static uint32_t zero = 0; // in RAM, until the SoftDevice gets to it
+    uint8_t sdEnabled = 0;
+    sd_softdevice_is_enabled(&sdEnabled);
+    if (sdEnabled) {
+      sd_flash_write(&r->reported, &zero, 1);
+    } else {
+      nvmcConfig(NVMC_CONFIG_WEN_Wen);
+      r->reported = zero;
+      nvmcWait();
+      nvmcConfig(NVMC_CONFIG_WEN_Ren);
     }
+  }
 
-    int count(RefCollection *c) { return c->data.size(); }
-
-    void add(RefCollection *c, uint32_t x) {
-      if (c->flags & 1) incr(x);
-      c->data.push_back(x);
-    }
 
-    inline bool in_range(RefCollection *c, int x) {
-      return (0 <= x && x < (int)c->data.size());
-    }
+  // ---------------------------------------------------------------------------
+  // Handler watchdog
+  // ---------------------------------------------------------------------------
 
-    uint32_t at(RefCollection *c, int x) {
-      if (in_range(c, x)) {
-        uint32_t tmp = c->data.at(x);
-        if (c->flags & 1) incr(tmp);
-        return tmp;
-      }
-      else {
-        error(ERR_OUT_OF_BOUNDS);
-        return 0;
-      }
-    }
+  // Scheduling is cooperative, so a handler looping without pause() holds up
+  // every other fiber and the board looks frozen. The watchdog is a system
+  // component, ticked from the DAL's timer interrupt; it measures how long
+  // the current fiber has gone without yielding. A yield shows up as another
+  // fiber running at the next tick, or as the idle fiber getting to its idle
+  // components, so the figures have tick (6ms) resolution.
+  //
+  // Handlers run by dispatchEvent() and forever_stub() are timed under their
+  // event (forever() loops under BITVM_ID_FOREVER, numbered as they start).
+  // A handler that stays busy past its budget is counted, and reported when
+  // it returns; BITVM_EVT_WATCHDOG is raised from the idle fiber. Past
+  // resetAfterMs (off unless set) the board is reset instead, with a crash
+  // record (ERR_WATCHDOG, the busy time in ms as subcode). A handler that
+  // blocked once has moved to a fiber of its own (the DAL's fork-on-block)
+  // and is only counted globally after that.
+  //
+  // Up to BITVM_WATCHDOG_RUNS handlers are followed at a time. A handler that
+  // blocks for good (waiting for an event that never comes, say) never gives
+  // its slot back, and neither does one whose fiber the DAL has released, so
+  // when they're all taken the oldest one on another fiber is reclaimed.
+#ifndef BITVM_WATCHDOG_BUDGET_MS
+#define BITVM_WATCHDOG_BUDGET_MS 500
+#endif
+#ifndef BITVM_WATCHDOG_RESET_MS
+#define BITVM_WATCHDOG_RESET_MS 0
+#endif
+#define BITVM_WATCHDOG_RUNS 8
+
+  struct HandlerStats {
+    uint32_t runs;
+    uint32_t totalUs;   // wall time, pauses included
+    uint32_t maxUs;
+    uint32_t maxBusyUs; // longest stretch without yielding
+    uint16_t overruns;
+    uint16_t budgetMs;  // 0 for the default
+  };
 
-    void remove_at(RefCollection *c, int x) {
-      if (!in_range(c, x))
-        return;
+  // What the interrupt sees of the handlers in progress.
+  struct WatchedRun {
+    Fiber *volatile fiber; // NULL for a free slot; written last
+    HandlerStats *stats;
+    uint16_t source;
+    uint16_t value;
+    uint32_t seq;       // start order, to find the innermost
+    volatile uint32_t overrunUs; // busy time while over budget
+  };
 
-      if (c->flags & 1) decr(c->data.at(x));
-      c->data.erase(c->data.begin()+x);
-    }
+  struct HandlerRun {
+    HandlerStats *stats;
+    uint32_t startUs;
+    uint32_t seq;       // to tell whether the slot was reclaimed
+    int slot;
+  };
 
-    void set_at(RefCollection *c, int x, uint32_t y) {
-      if (!in_range(c, x))
-        return;
+  static map<pair<int, int>, HandlerStats> handlerStats;
+  static WatchedRun watchedRuns[BITVM_WATCHDOG_RUNS];
+  static uint32_t watchedRunSeq;
+  static uint16_t defaultBudgetMs = BITVM_WATCHDOG_BUDGET_MS;
+  static uint16_t resetAfterMs = BITVM_WATCHDOG_RESET_MS;
+  static bool watchdogRunning; // false if the DAL had no room for it
+  WatchdogStats watchdogStats;
 
-      if (c->flags & 1) {
-        decr(c->data.at(x));
-        incr(y);
-      }
-      c->data.at(x) = y;
-    }
+  // Budgets are kept in 16 bits; longer ones are cut to 65s.
+  static uint16_t clampMs(int ms)
+  {
+    return ms < 0 ? 0 : ms > 0xffff ? 0xffff : ms;
+  }
 
-    int index_of(RefCollection *c, uint32_t x, int start) {
-      if (!in_range(c, start))
-        return -1;
+  // Looking up a handler that never ran doesn't add it.
+  static HandlerStats *findStats(int source, int value)
+  {
+    auto it = handlerStats.find({ source, value });
+    return it == handlerStats.end() ? NULL : &it->second;
+  }
 
-      if (c->flags & 2) {
-        StringData *xx = (StringData*)x;
-        for (uint32_t i = start; i < c->data.size(); ++i) {
-          StringData *ee = (StringData*)c->data.at(i);
-          if (xx->len == ee->len && memcmp(xx->data, ee->data, xx->len) == 0)
-            return (int)i;
-        }
-      } else {
-        for (uint32_t i = start; i < c->data.size(); ++i)
-          if (c->data.at(i) == x)
-            return (int)i;
+  static void handlerStart(HandlerRun &run, int source, int value)
+  {
+    run.stats = &handlerStats[{ source, value }];
+    run.startUs = us_ticker_read();
+    run.slot = -1;
+    for (int i = 0; i < BITVM_WATCHDOG_RUNS; ++i) {
+      WatchedRun &w = watchedRuns[i];
+      if (w.fiber == NULL) {
+        run.slot = i;
+        break;
       }
+      if (w.fiber != currentFiber && (run.slot < 0 || w.seq < watchedRuns[run.slot].seq))
+        run.slot = i;
+    }
+    if (run.slot < 0)
+      return;
+
+    WatchedRun &w = watchedRuns[run.slot];
+    w.fiber = NULL;
+    __asm volatile("" ::: "memory");
+    w.stats = run.stats;
+    w.source = source;
+    w.value = value;
+    w.seq = run.seq = ++watchedRunSeq;
+    w.overrunUs = 0;
+    __asm volatile("" ::: "memory");
+    w.fiber = currentFiber;
+  }
 
-      return -1;
+  static void handlerEnd(HandlerRun &run)
+  {
+    uint32_t len = us_ticker_read() - run.startUs;
+    HandlerStats *st = run.stats;
+    st->runs++;
+    st->totalUs += len;
+    if (len > st->maxUs)
+      st->maxUs = len;
+
+    if (run.slot >= 0 && watchedRuns[run.slot].seq == run.seq) {
+      WatchedRun &w = watchedRuns[run.slot];
+      uint32_t overrun = w.overrunUs;
+      w.fiber = NULL;
+      if (overrun)
+        printf("Watchdog: handler %d/%d ran %dms without yielding (budget %dms)\n",
+               w.source, w.value, overrun / 1000, st->budgetMs ? st->budgetMs : defaultBudgetMs);
     }
+  }
 
-    int remove(RefCollection *c, uint32_t x) {
-      int idx = index_of(c, x, 0);
-      if (idx >= 0) {
-        remove_at(c, idx);
-        return 1;
+  class Watchdog : public MicroBitComponent
+  {
+    Fiber *lastFiber;
+    uint32_t busySinceUs;
+    volatile bool yielded;
+    volatile bool raiseEvent;
+    bool overBudget;
+
+  public:
+    virtual void systemTick()
+    {
+      uint32_t now = us_ticker_read();
+      Fiber *f = currentFiber;
+      if (f != lastFiber || yielded) {
+        lastFiber = f;
+        yielded = false;
+        busySinceUs = now;
+        overBudget = false;
+        return;
       }
 
-      return 0;
-    }
-  }
+      uint32_t busy = now - busySinceUs;
+      if (busy > watchdogStats.maxBusyUs)
+        watchdogStats.maxBusyUs = busy;
+
+      // the innermost handler of this fiber is the last one started
+      WatchedRun *run = NULL;
+      for (int i = 0; i < BITVM_WATCHDOG_RUNS; ++i)
+        if (watchedRuns[i].fiber == f && (run == NULL || watchedRuns[i].seq > run->seq))
+          run = &watchedRuns[i];
+      uint32_t budgetMs = defaultBudgetMs;
+      if (run) {
+        if (busy > run->stats->maxBusyUs)
+          run->stats->maxBusyUs = busy;
+        if (run->stats->budgetMs)
+          budgetMs = run->stats->budgetMs;
+      }
 
-  namespace buffer {
+      if (!overBudget && busy > budgetMs * 1000) {
+        overBudget = true;
+        watchdogStats.overruns++;
+        if (run)
+          run->stats->overruns++;
+        raiseEvent = true;
+      }
+      if (overBudget && run)
+        run->overrunUs = busy;
 
-    RefBuffer *mk(uint32_t size)
-    {
-      RefBuffer *r = new RefBuffer();
-      r->data.resize(size);
-      return r;
+      if (resetAfterMs && busy > resetAfterMs * 1000) {
+        writeCrashRecord(ERR_WATCHDOG, busy / 1000);
+        uBit.reset();
+      }
     }
 
-    char *cptr(RefBuffer *c)
+    virtual void idleTick()
     {
-      return (char*)&c->data[0];
+      yielded = true;
+      if (raiseEvent) {
+        raiseEvent = false;
+        MicroBitEvent evt(BITVM_ID_RUNTIME, BITVM_EVT_WATCHDOG);
+      }
     }
 
-    int count(RefBuffer *c) { return c->data.size(); }
-
-    void fill(RefBuffer *c, int v)
+    // idleTick() also runs whenever the idle fiber does; this only asks for
+    // it to be scheduled early when there's an event to raise.
+    virtual int isIdleCallbackNeeded()
     {
-      memset(cptr(c), v, count(c));
+      return raiseEvent;
     }
+  };
 
-    void fill_random(RefBuffer *c)
-    {
-      int len = count(c);
-      for (int i = 0; i < len; ++i)
-        c->data[i] = uBit.random(0x100);
-    }
+  static Watchdog watchdogComponent;
 
-    void add(RefBuffer *c, uint32_t x) {
-      c->data.push_back(x);
+  // The idle part goes first: without it, every fiber would look busy.
+  static void watchdogStart()
+  {
+    if (uBit.addIdleComponent(&watchdogComponent) == MICROBIT_OK) {
+      if (uBit.addSystemComponent(&watchdogComponent) == MICROBIT_OK)
+        watchdogRunning = true;
+      else
+        uBit.removeIdleComponent(&watchdogComponent);
     }
+    if (!watchdogRunning)
+      printf("Watchdog: no room for another DAL component, not running\n");
+  }
 
-    inline bool in_range(RefBuffer *c, int x) {
-      return (0 <= x && x < (int)c->data.size());
+  // Budgets and statistics for tuning them, in milliseconds. Handlers are
+  // named by the event they handle, as in micro_bit::on_event().
+  namespace watchdog {
+    // [ms] of 0 goes back to the default budget.
+    void set_budget(int source, int value, int ms)
+    {
+      handlerStats[{ source, value }].budgetMs = clampMs(ms);
     }
 
-    uint32_t at(RefBuffer *c, int x) {
-      if (in_range(c, x)) {
-        return c->data[x];
-      }
-      else {
-        error(ERR_OUT_OF_BOUNDS);
-        return 0;
-      }
+    void set_default_budget(int ms)
+    {
+      defaultBudgetMs = clampMs(ms);
     }
 
-    void set(RefBuffer *c, int x, uint32_t y) {
-      if (!in_range(c, x))
-        return;
-      c->data[x] = y;
+    // Reset the board when a handler stays busy this long; 0 never does.
+    void set_reset_after(int ms)
+    {
+      resetAfterMs = clampMs(ms);
     }
-  }
 
-  namespace bitvm_bits {
-    RefBuffer *create_buffer(int size)
+    // Longest time any fiber went without yielding.
+    int max_busy()
     {
-      return buffer::mk(size);
+      return watchdogStats.maxBusyUs / 1000;
     }
-  }
 
-  namespace record {
-    RefRecord* mk(int reflen, int totallen)
+    int overruns()
     {
-      check(0 <= reflen && reflen <= totallen, ERR_SIZE, 1);
-      check(reflen <= totallen && totallen <= 255, ERR_SIZE, 2);
-
-      void *ptr = ::operator new(sizeof(RefRecord) + totallen * sizeof(uint32_t));
-      RefRecord *r = new (ptr) RefRecord();
-      r->len = totallen;
-      r->reflen = reflen;
-      memset(r->fields, 0, r->len * sizeof(uint32_t));
-      return r;
+      return watchdogStats.overruns;
     }
-  }
-
-  typedef uint32_t Action;
 
-  namespace action {
-    Action mk(int reflen, int totallen, int startptr)
+    int handler_max_busy(int source, int value)
     {
-      check(0 <= reflen && reflen <= totallen, ERR_SIZE, 1);
-      check(reflen <= totallen && totallen <= 255, ERR_SIZE, 2);
-      check(bytecode[startptr] == 0xffff, ERR_INVALID_BINARY_HEADER, 3);
-      check(bytecode[startptr + 1] == 0, ERR_INVALID_BINARY_HEADER, 4);
-
-
-      uint32_t tmp = (uint32_t)&bytecode[startptr];
-
-      if (totallen == 0) {
-        return tmp; // no closure needed
-      }
-
-      void *ptr = ::operator new(sizeof(RefAction) + totallen * sizeof(uint32_t));
-      RefAction *r = new (ptr) RefAction();
-      r->len = totallen;
-      r->reflen = reflen;
-      r->func = (ActionCB)((tmp + 4) | 1);
-      memset(r->fields, 0, r->len * sizeof(uint32_t));
-
-      return (Action)r;
+      HandlerStats *st = findStats(source, value);
+      return st ? st->maxBusyUs / 1000 : 0;
     }
 
-    void run1(Action a, int arg)
+    int handler_overruns(int source, int value)
     {
-      if (hasVTable(a))
-        ((RefAction*)a)->run(arg);
-      else {
-        check(*(uint16_t*)a == 0xffff, ERR_INVALID_BINARY_HEADER, 4);
-        ((ActionCB)((a + 4) | 1))(NULL, NULL, arg);
-      }
+      HandlerStats *st = findStats(source, value);
+      return st ? st->overruns : 0;
     }
 
-    void run(Action a)
+    // Prints every handler that has run, with its statistics.
+    void report()
     {
-      action::run1(a, 0);
+      if (!watchdogRunning)
+        printf("Watchdog: not running\n");
+      printf("Watchdog: longest busy %dms, %d overruns\n", watchdogStats.maxBusyUs / 1000, watchdogStats.overruns);
+      for (auto &h : handlerStats) {
+        HandlerStats &st = h.second;
+        if (st.runs == 0)
+          continue;
+        printf("  %d/%d: %d runs, mean %dms, max %dms, busy %dms, %d overruns, budget %dms\n",
+               h.first.first, h.first.second, st.runs, st.totalUs / st.runs / 1000,
+               st.maxUs / 1000, st.maxBusyUs / 1000, st.overruns,
+               st.budgetMs ? st.budgetMs : defaultBudgetMs);
+      }
     }
   }
 
@@ -461,13 +2204,26 @@ namespace bitvm {
     // for a given event, then [handlersMap] contains a valid entry for that
     // event.
     void dispatchEvent(MicroBitEvent e) {
+      noteEvent(e.source, e.value);
+      bool arena = scratch::enter(e.source, e.value);
+
+      HandlerRun run;
       Action curr = handlersMap[{ e.source, e.value }];
-      if (curr)
+      if (curr) {
+        handlerStart(run, e.source, e.value);
         action::run(curr);
+        handlerEnd(run);
+      }
 
       curr = handlersMap[{ e.source, MICROBIT_EVT_ANY }];
-      if (curr)
+      if (curr) {
+        handlerStart(run, e.source, MICROBIT_EVT_ANY);
         action::run1(curr, e.value);
+        handlerEnd(run);
+      }
+
+      if (arena)
+        scratch::leave(e.source, e.value);
     }
 
     void registerWithDal(int id, int event, Action a) {
@@ -505,6 +2261,12 @@ namespace bitvm {
         }
     }
 
+    void onLowMemory(Action a) {
+      if (a != 0) {
+        registerWithDal(BITVM_ID_RUNTIME, BITVM_EVT_LOW_MEMORY, a);
+      }
+    }
+
 
     // -------------------------------------------------------------------------
     // Pins
@@ -576,9 +2338,15 @@ namespace bitvm {
       }
     }
 
+    static int numForevers;
+
     void forever_stub(void *a) {
+      int idx = numForevers++;
+      HandlerRun run;
       while (true) {
+        handlerStart(run, BITVM_ID_FOREVER, idx);
         action::run((Action)a);
+        handlerEnd(run);
         micro_bit::pause(20);
       }
     }
@@ -714,6 +2482,7 @@ namespace bitvm {
 
     void panic(int code)
     {
+      saveCrashRecord(code, 0);
       uBit.panic(code);
     }
 
@@ -762,10 +2531,98 @@ namespace bitvm {
   }
 
 
+#ifdef DEBUG_MEMLEAKS
+  // Sends every live RefObject, with its outgoing references, and the roots
+  // (globals, registered event handlers) over serial, for scripts/heapsnap.js.
+  // All addresses are relative to the start of RAM; references to flash are
+  // left out. The format is
+  //
+  //   "BVHS\x01" varint(numObjects)
+  //     { varint(addr) type varint(size) varint(refcnt) varint(numRefs) { varint(addr) } }
+  //   varint(numRoots) { kind varint(key) varint(addr) }
+  //   "BVHE"
+  //
+  // where root kind is 0 for a global (key is its index), 1 for a handler
+  // (key is source << 16 | value). Only globals the program stores with
+  // stglbRef() are roots; the others hold numbers and booleans. Strings and
+  // images appear as REF_NATIVE objects of unknown size.
+  static inline void sendRef(uint32_t v)
+  {
+    sendVarint(v - BITVM_RAM_START);
+  }
+
+  static inline bool isRefGlobal(int idx)
+  {
+    return (refGlobals[idx >> 3] >> (idx & 7)) & 1;
+  }
+
+  void heapSnapshot()
+  {
+    while (freeQueueLen > 0)
+      gcSlice(INT_MAX);
+
+    std::set<uint32_t> natives;
+    for (auto o : allptrs)
+      for (int i = 0; i < o->numRefs(); ++i) {
+        uint32_t r = o->getRef(i);
+        if (!isImmortal(r) && !hasVTable(r))
+          natives.insert(r);
+      }
+
+    sendBytes("BVHS\x01");
+    sendVarint(allptrs.size() + natives.size());
+    for (auto o : allptrs) {
+      sendRef((uint32_t)o);
+      uBit.serial.putc(o->typeId());
+      sendVarint(o->byteSize());
+      sendVarint(o->refcnt);
+      int n = 0;
+      for (int i = 0; i < o->numRefs(); ++i)
+        if (!isImmortal(o->getRef(i)))
+          n++;
+      sendVarint(n);
+      for (int i = 0; i < o->numRefs(); ++i)
+        if (!isImmortal(o->getRef(i)))
+          sendRef(o->getRef(i));
+    }
+    for (auto r : natives) {
+      sendRef(r);
+      uBit.serial.putc(REF_NATIVE);
+      sendVarint(0);
+      sendVarint(((RefCounted*)r)->refCount >> 1);
+      sendVarint(0);
+    }
+
+    int numRoots = 0;
+    for (int i = 0; i < numGlobals; ++i)
+      if (isRefGlobal(i) && !isImmortal(globals[i]))
+        numRoots++;
+    for (auto &h : bitvm_micro_bit::handlersMap)
+      if (!isImmortal(h.second))
+        numRoots++;
+    sendVarint(numRoots);
+    for (int i = 0; i < numGlobals; ++i)
+      if (isRefGlobal(i) && !isImmortal(globals[i])) {
+        uBit.serial.putc(0);
+        sendVarint(i);
+        sendRef(globals[i]);
+      }
+    for (auto &h : bitvm_micro_bit::handlersMap)
+      if (!isImmortal(h.second)) {
+        uBit.serial.putc(1);
+        sendVarint((h.first.first << 16) | (h.first.second & 0xffff));
+        sendRef(h.second);
+      }
+    sendBytes("BVHE");
+  }
+#else
+  void heapSnapshot() {}
+#endif
+
   void error(ERROR code, int subcode)
   {
     printf("Error: %d [%d]\n", code, subcode);
-    die();
+    die(code, subcode);
   }
 
 
@@ -810,11 +2667,20 @@ namespace bitvm {
     
     // repeat error 4 times and restart as needed
     uBit.display.setErrorTimeout(4);
+
+    reportCrashRecord();
+
+    addIdleWork(&freeQueueIdle);
+    addIdleWork(&isrQueueIdle);
+    watchdogStart();
     
     uint32_t ver = *pc++;
     checkStr(ver == 0x4207, ":( Bad runtime version");
     numGlobals = *pc++;
     globals = allocate(numGlobals);
+#ifdef DEBUG_MEMLEAKS
+    refGlobals = new uint8_t[(numGlobals + 7) / 8]();
+#endif
 
     bytecode = *((uint16_t**)pc);  // the actual bytecode is here
     pc += 2;
@@ -831,6 +2697,8 @@ namespace bitvm {
     ((uint32_t (*)())startptr)();
 
 #ifdef DEBUG_MEMLEAKS
+    while (freeQueueLen > 0)
+      gcSlice(INT_MAX);
     bitvm::debugMemLeaks();
 #endif
 